@@ -31,6 +31,7 @@ typedef struct {
   int pc;
   int subsection;
   DataPrivate* data;
+  Label* labels;
   bool prev_boundary;
 } Parser;
 
@@ -330,6 +331,10 @@ static void parse_line(Parser* p, int c) {
         value = p->pc;
         p->prev_boundary = true;
         p->symtab = table_add(p->symtab, strdup(buf), (void*)value);
+        p->labels->next = calloc(1, sizeof(Label));
+        p->labels = p->labels->next;
+        p->labels->name = p->symtab->key;
+        p->labels->pc = value;
       } else {
         DataPrivate* d = add_data(p);
         d->val.type = LABEL;
@@ -490,12 +495,14 @@ static void parse_line(Parser* p, int c) {
 static void parse_eir(Parser* p) {
   Inst text_root = {};
   DataPrivate data_root = {};
+  Label label_root = {};
   int c;
 
   p->in_text = 1;
   p->lineno = 1;
   p->text = &text_root;
   p->data = &data_root;
+  p->labels = &label_root;
   p->pc = 0;
   p->prev_boundary = true;
 
@@ -533,6 +540,7 @@ static void parse_eir(Parser* p) {
   serialize_data(p, &data_root);
   p->text = text_root.next;
   p->data = data_root.next;
+  p->labels = label_root.next;
 }
 
 static void resolve(Value* v, Table* symtab) {
@@ -573,6 +581,7 @@ Module* load_eir_impl(const char* filename, FILE* fp) {
   Module* m = malloc(sizeof(Module));
   m->text = parser.text;
   m->data = (Data*)parser.data;
+  m->labels = parser.labels;
   return m;
 }
 
@@ -53,9 +53,17 @@ typedef struct Data_ {
   struct Data_* next;
 } Data;
 
+typedef struct Label_ {
+  const char* name;
+  int pc;
+  struct Label_* next;
+} Label;
+
 typedef struct {
   Inst* text;
   Data* data;
+  // Labels in .text, ordered by pc.
+  Label* labels;
 } Module;
 
 Module* load_eir(FILE* fp);
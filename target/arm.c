@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <ir/ir.h>
 #include <target/util.h>
@@ -37,7 +38,7 @@ static int ARMREG[] = {
 #define ARM_SP ((Reg)13)
 #define ARM_PC ((Reg)15)
 
-void emit_elf_header(uint16_t machine, uint32_t filesz);
+static bool ARM_V7 = false;
 
 static void emit_4le(int a, int b, int c, int d) {
   emit_1(d);
@@ -87,7 +88,45 @@ static void emit_arm_sub_imm8(Reg dst, int imm8, ImmRot rot) {
   emit_4le(0xe2, ARM_SUB + ARMREG[dst], ARMREG[dst] * 16 + rot, imm8);
 }
 
+// Finds an 8-bit value and an even rotation which represent |imm| as an
+// ARM modified immediate. Only left shifts are considered as |imm| never
+// has bits above the 24th.
+static bool arm_imm8(int imm, int* imm8, ImmRot* rot) {
+  for (int s = 0; s <= 16; s += 2) {
+    if (imm % (1 << s) == 0 && imm / (1 << s) < 256) {
+      *imm8 = imm / (1 << s);
+      *rot = (ImmRot)((16 - s / 2) % 16);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void emit_arm_movw(Reg dst, int imm16) {
+  emit_4le(0xe3, imm16 / 4096, ARMREG[dst] * 16 + imm16 / 256 % 16,
+           imm16 % 256);
+}
+
+static void emit_arm_movt(Reg dst, int imm16) {
+  emit_4le(0xe3, 0x40 + imm16 / 4096, ARMREG[dst] * 16 + imm16 / 256 % 16,
+           imm16 % 256);
+}
+
 static void emit_arm_mov_imm(Reg dst, int imm) {
+  int imm8;
+  ImmRot rot;
+  if (arm_imm8(imm, &imm8, &rot)) {
+    emit_arm_mov_imm8(dst, imm8, rot);
+    return;
+  }
+
+  if (ARM_V7) {
+    emit_arm_movw(dst, imm % 65536);
+    if (imm / 65536)
+      emit_arm_movt(dst, imm / 65536);
+    return;
+  }
+
   emit_arm_mov_imm8(dst, imm % 256, Shl0);
   imm /= 256;
   if (!imm)
@@ -100,8 +139,14 @@ static void emit_arm_mov_imm(Reg dst, int imm) {
 }
 
 static void emit_arm_add_imm(Reg dst, int imm) {
-  if (imm > 0xffff00) {
-    emit_arm_sub_imm8(dst, 0x1000000 - imm, Shl0);
+  int imm8;
+  ImmRot rot;
+  if (arm_imm8(imm, &imm8, &rot)) {
+    emit_arm_add_imm8(dst, imm8, rot);
+    return;
+  }
+  if (arm_imm8(0x1000000 - imm, &imm8, &rot)) {
+    emit_arm_sub_imm8(dst, imm8, rot);
     return;
   }
 
@@ -117,6 +162,17 @@ static void emit_arm_add_imm(Reg dst, int imm) {
 }
 
 static void emit_arm_sub_imm(Reg dst, int imm) {
+  int imm8;
+  ImmRot rot;
+  if (arm_imm8(imm, &imm8, &rot)) {
+    emit_arm_sub_imm8(dst, imm8, rot);
+    return;
+  }
+  if (arm_imm8(0x1000000 - imm, &imm8, &rot)) {
+    emit_arm_add_imm8(dst, imm8, rot);
+    return;
+  }
+
   emit_arm_sub_imm8(dst, imm % 256, Shl0);
   imm /= 256;
   if (!imm)
@@ -137,10 +193,20 @@ static void emit_arm_mem(LoadOrStore op, Reg val, Reg base, Reg offset) {
   emit_4le(0xe7, op + ARMREG[base], ARMREG[val] * 16 + 1, ARMREG[offset]);
 }
 
+static void emit_arm_mem_imm(LoadOrStore op, Reg val, Reg base, int offset) {
+  emit_4le(0xe5, op + ARMREG[base], ARMREG[val] * 16 + offset / 256,
+           offset % 256);
+}
+
 static void emit_arm_cmp(Inst* inst) {
   Reg reg;
+  int imm8;
+  ImmRot rot;
   if (inst->src.type == REG) {
     reg = inst->src.reg;
+  } else if (arm_imm8(inst->src.imm, &imm8, &rot)) {
+    emit_4le(0xe3, 0x50 + ARMREG[inst->dst.reg], rot, imm8);
+    return;
   } else {
     reg = R0;
     emit_arm_mov_imm(reg, inst->src.imm);
@@ -154,6 +220,17 @@ static void emit_arm_setcc(Inst* inst, int op) {
   emit_4le(op, 0xa0, ARMREG[inst->dst.reg] * 16, 0x01);
 }
 
+static Reloc* g_relocs;
+
+static void patch_arm_branch(int addr, int target) {
+  uint32_t v = target / 4 - (addr + 8) / 4;
+  emit_patch_1(addr, v % 256);
+  v /= 256;
+  emit_patch_1(addr + 1, v % 256);
+  v /= 256;
+  emit_patch_1(addr + 2, v % 256);
+}
+
 static void emit_arm_jcc(Inst* inst, int op, int* pc2addr) {
   if (inst->op != JMP) {
     emit_arm_cmp(inst);
@@ -162,47 +239,34 @@ static void emit_arm_jcc(Inst* inst, int op, int* pc2addr) {
   if (inst->jmp.type == REG) {
     emit_arm_mem(MEM_LOAD, ARM_PC, RODATA, inst->jmp.reg);
   } else {
-    uint32_t v = pc2addr[inst->jmp.imm] / 4 - (emit_cnt() + 8) / 4;
-    emit_1(v % 256);
-    v /= 256;
-    emit_1(v % 256);
-    v /= 256;
-    emit_1(v % 256);
-    emit_1(op);
+    int addr = emit_cnt();
+    emit_4le(op, 0, 0, 0);
+    if (inst->jmp.imm <= inst->pc) {
+      patch_arm_branch(addr, pc2addr[inst->jmp.imm]);
+    } else {
+      g_relocs = add_reloc(g_relocs, addr, inst->jmp.imm);
+    }
   }
 }
 
-static void init_state_arm(Data* data, int rodata_addr) {
-  emit_arm_mov_imm8(R0, 0, Shl0);
-  emit_arm_mov_imm8(R1, 4, Shl24);
-  emit_arm_mov_imm8(R2, 3, Shl0);  // PROT_READ | PROT_WRITE
-  emit_arm_mov_imm8(R3, 0x22, Shl0);  // MAP_PRIVATE | MAP_ANONYMOUS
-  emit_arm_mvn_imm8(R4, 0, Shl0);  // 0xffffffff
-  emit_arm_mov_imm8(R5, 0, Shl0);
-  emit_arm_mov_imm8(R7, 192, Shl0);  // mmap2
-  emit_svc();
-
-  emit_arm_mov_reg(ARM_MEM, R0);
-
-  int prev = 0;
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (!data->v)
-      continue;
-    int d = (mp - prev) * 4;
-    if (d >= 4096) {
-      emit_arm_add_imm(R0, d);
-      d = 0;
-    }
-    emit_arm_mov_imm(R1, data->v);
-    emit_4le(0xe5, 0xa0, 0x10 + d / 256, d % 256);
-    prev = mp;
-  }
+static void emit_arm_mov_addr(Reg dst, int reloc) {
+  g_relocs = add_reloc(g_relocs, emit_cnt(), reloc);
+  emit_arm_mov_imm8(dst, 0, Shl0);
+  emit_arm_add_imm8(dst, 0, Shl8);
+  emit_arm_add_imm8(dst, 0, Shl16);
+}
+
+static void patch_arm_mov_addr(int addr, int v) {
+  emit_patch_1(addr, v % 256);
+  v /= 256;
+  emit_patch_1(addr + 4, v % 256);
+  v /= 256;
+  emit_patch_1(addr + 8, v % 256);
+}
 
-  emit_arm_mov_imm8(RODATA, rodata_addr % 256, Shl0);
-  rodata_addr /= 256;
-  emit_arm_add_imm8(RODATA, rodata_addr % 256, Shl8);
-  rodata_addr /= 256;
-  emit_arm_add_imm8(RODATA, rodata_addr % 256, Shl16);
+static void init_state_arm() {
+  emit_arm_mov_addr(ARM_MEM, RELOC_DATA);
+  emit_arm_mov_addr(RODATA, RELOC_RODATA);
   emit_arm_mvn_imm8(FFFFFF, 0xff, Shl24);
 
   emit_arm_mov_imm8(A, 0, Shl0);
@@ -247,6 +311,10 @@ static void arm_emit_inst(Inst* inst, int* pc2addr) {
   case STORE:
     if (inst->src.type == REG) {
       reg = inst->src.reg;
+    } else if (inst->src.imm < 1024) {
+      emit_arm_mem_imm(inst->op == LOAD ? MEM_LOAD : MEM_STORE,
+                       inst->dst.reg, ARM_MEM, inst->src.imm * 4);
+      break;
     } else {
       emit_arm_mov_imm(R0, inst->src.imm);
       reg = R0;
@@ -348,14 +416,14 @@ static void arm_emit_inst(Inst* inst, int* pc2addr) {
 }
 
 void target_arm(Module* module) {
-  emit_reset();
-  init_state_arm(module->data, 0);
-
   int pc_cnt = 0;
   for (Inst* inst = module->text; inst; inst = inst->next) {
     pc_cnt++;
   }
 
+  emit_buffer_start();
+  init_state_arm();
+
   int* pc2addr = calloc(pc_cnt, sizeof(int));
   int prev_pc = -1;
   for (Inst* inst = module->text; inst; inst = inst->next) {
@@ -367,18 +435,31 @@ void target_arm(Module* module) {
   }
 
   int rodata_addr = ELF_TEXT_START + emit_cnt() + ELF_HEADER_SIZE;
+  for (int i = 0; i < pc_cnt; i++) {
+    emit_le(ELF_TEXT_START + pc2addr[i] + ELF_HEADER_SIZE);
+  }
+  int filesz = emit_cnt();
 
-  emit_elf_header(40, emit_cnt() + pc_cnt * 4);
-
-  emit_reset();
-  emit_start();
-  init_state_arm(module->data, rodata_addr);
-
-  for (Inst* inst = module->text; inst; inst = inst->next) {
-    arm_emit_inst(inst, pc2addr);
+  for (Reloc* r = g_relocs; r; r = r->next) {
+    if (r->pc == RELOC_RODATA) {
+      patch_arm_mov_addr(r->addr, rodata_addr);
+    } else if (r->pc == RELOC_DATA) {
+      patch_arm_mov_addr(r->addr, elf_data_addr(filesz));
+    } else {
+      patch_arm_branch(r->addr, pc2addr[r->pc]);
+    }
   }
 
-  for (int i = 0; i < pc_cnt; i++) {
-    emit_le(ELF_TEXT_START + pc2addr[i] + ELF_HEADER_SIZE);
+  emit_elf_header(40, filesz, module);
+  emit_elf_data(module->data);
+  emit_elf_symbols(module, filesz, pc2addr);
+  emit_buffer_flush();
+}
+
+bool handle_arm_args(const char* key, const char* value) {
+  if (!strcmp(key, "armv7")) {
+    ARM_V7 = parse_bool_value(value);
+    return true;
   }
+  return handle_elf_args(key, value);
 }
@@ -1,8 +1,31 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// VM registers live in these between chunk functions, which work on
+// locals named after reg_names.
+static const char* ASMJS_GLOBAL_REGS[6] = {
+  "A", "B", "C", "D", "BP", "SP"
+};
+
 static void init_state_asmjs(Data* data) {
   emit_line("var main = function() {");
+  // The data image is one base64 string, with four characters per word,
+  // which is decoded into the heap before the module is linked.
+  emit_line("var data = [");
+  emit_data_base64(data);
+  emit_line("].join('');");
+  emit_line("var init = function(mem) {");
+  emit_line(" var b = new Int32Array(128);");
+  emit_line(" var t = "
+            "'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/';");
+  emit_line(" for (var i = 0; i < 64; i++) b[t.charCodeAt(i)] = i;");
+  emit_line(" for (var i = 0; i < data.length; i += 4) {");
+  emit_line("  mem[i >> 2] = (b[data.charCodeAt(i)] << 18 |");
+  emit_line("                 b[data.charCodeAt(i + 1)] << 12 |");
+  emit_line("                 b[data.charCodeAt(i + 2)] << 6 |");
+  emit_line("                 b[data.charCodeAt(i + 3)]);");
+  emit_line(" }");
+  emit_line("};");
   emit_line("var mod = function(stdlib, foreign, heap) {");
   emit_line("\"use asm\";");
   emit_line("var mem = new stdlib.Int32Array(heap);");
@@ -10,28 +33,22 @@ static void init_state_asmjs(Data* data) {
   emit_line("var getchar = foreign.getchar;");
   emit_line("var running = 1;");
 
-  for (int i = 0; i < 7; i++) {
-    emit_line("var %s = 0;", reg_names[i]);
-  }
-  emit_line("function init() {");
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("mem[%d] = %d;", mp, data->v);
-    }
+  for (int i = 0; i < 6; i++) {
+    emit_line("var %s = 0;", ASMJS_GLOBAL_REGS[i]);
   }
-  emit_line("}");
+  emit_line("var pc = 0;");
 }
 
 static void asmjs_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("function func%d() {", func_id);
   inc_indent();
-  emit_line("while ((%d <= (pc | 0)) & ((pc | 0) < %d) & running) {",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
-  inc_indent();
-  emit_line("switch (pc | 0) {");
-  emit_line("case -1:  // dummy");
-  inc_indent();
+  for (int i = 0; i < 6; i++) {
+    emit_line("var %s = 0;", reg_names[i]);
+  }
+  for (int i = 0; i < 6; i++) {
+    emit_line("%s = %s | 0;", reg_names[i], ASMJS_GLOBAL_REGS[i]);
+  }
 }
 
 static const char *unsigned_cmp_str(Inst *inst) {
@@ -59,23 +76,13 @@ static const char *unsigned_cmp_str(Inst *inst) {
 }
 
 static void asmjs_emit_func_epilogue(void) {
-  dec_indent();
-  emit_line("}"); /* switch (pc) */
-  emit_line("pc = (pc + 1) | 0;");
-  dec_indent();
-  emit_line("}"); /* while (_ <= pc && pc < _ && running) */
+  for (int i = 0; i < 6; i++) {
+    emit_line("%s = %s;", ASMJS_GLOBAL_REGS[i], reg_names[i]);
+  }
   dec_indent();
   emit_line("}"); /* function func%d */
 }
 
-static void asmjs_emit_pc_change(int pc) {
-  emit_line("break;");
-  emit_line("");
-  dec_indent();
-  emit_line("case %d:", pc);
-  inc_indent();
-}
-
 static void asmjs_emit_inst(Inst* inst) {
   switch (inst->op) {
   case MOV:
@@ -112,7 +119,7 @@ static void asmjs_emit_inst(Inst* inst) {
     break;
 
   case EXIT:
-    emit_line("running = 0; break;");
+    emit_line("running = 0; break dispatch;");
     break;
 
   case DUMP:
@@ -135,8 +142,8 @@ static void asmjs_emit_inst(Inst* inst) {
   case JLE:
   case JGE:
   case JMP:
-    emit_line("if (%s) pc = (%s - 1) | 0;",
-              unsigned_cmp_str(inst), value_str(&inst->jmp));
+    emit_line("if (%s) %s",
+              unsigned_cmp_str(inst), structured_jump_str(inst));
     break;
 
   default:
@@ -147,15 +154,13 @@ static void asmjs_emit_inst(Inst* inst) {
 void target_asmjs(Module* module) {
   init_state_asmjs(module->data);
 
-  int num_funcs = emit_chunked_main_loop(module->text,
-                                         asmjs_emit_func_prologue,
-                                         asmjs_emit_func_epilogue,
-                                         asmjs_emit_pc_change,
-                                         asmjs_emit_inst);
+  int num_funcs = emit_structured_main_loop(module,
+                                            asmjs_emit_func_prologue,
+                                            asmjs_emit_func_epilogue,
+                                            asmjs_emit_inst);
 
   emit_line("");
   emit_line("function main() {");
-  emit_line("init();");
   emit_line("while (running) {");
   inc_indent();
   emit_line("switch ((pc | 0) / %d | 0) {", CHUNKED_FUNC_SIZE);
@@ -172,7 +177,10 @@ void target_asmjs(Module* module) {
   emit_line("return main;");
   emit_line("};"); /* var mod = function() */
   emit_line("return function(getchar, putchar) {");
-  emit_line("return mod((0,eval)('this'), {getchar: getchar, putchar: putchar}, new ArrayBuffer(1 << 26))();");
+  emit_line("var heap = new ArrayBuffer(1 << 26);");
+  emit_line("init(new Int32Array(heap));");
+  emit_line("return mod((0,eval)('this'), "
+            "{getchar: getchar, putchar: putchar}, heap)();");
   emit_line("};"); /* function(getchar, putchar) */
   emit_line("}();"); /* var main = function() */
 
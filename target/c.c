@@ -1,14 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include <ir/ir.h>
 #include <target/util.h>
 
-static void c_init_state(void) {
+static int c_mem_bits = 24;
+
+// The data image is a static constant copied into memory at start-up, so
+// the compiler does not have to chew through a huge main and memory stays
+// in .bss.
+static void c_emit_mem(Data* data) {
+  c_mem_bits = mem_size_bits(data);
+  emit_line("unsigned int mem[1<<%d];", c_mem_bits);
+  int n = data_size(data);
+  if (n) {
+    emit_line("static const unsigned int mem_init[%d] = {", n);
+    emit_data_words(data);
+    emit_line("};");
+  }
+}
+
+static void c_emit_mem_init(Data* data) {
+  if (data_size(data)) {
+    emit_line("memcpy(mem, mem_init, sizeof(mem_init));");
+  }
+}
+
+static void c_init_state(Data* data) {
   emit_line("#include <stdio.h>");
   emit_line("#include <stdlib.h>");
+  emit_line("#include <string.h>");
 
   for (int i = 0; i < 7; i++) {
     emit_line("unsigned int %s;", reg_names[i]);
   }
-  emit_line("unsigned int mem[1<<24];");
+  c_emit_mem(data);
+}
+
+// Native function recovery. A jump which ends a basic block that also
+// materializes the address of the next pc is a call in the convention of
+// 8cc (push the return address, then jump). Call targets and named text
+// labels are function entries, and each entry owns the pcs up to the next
+// one. Every such function is also emitted as a C function which takes its
+// return address, so calls become C calls and jumps back to the return
+// address become C returns. Anything else which leaves the function
+// escapes to the pc dispatch loop by longjmp. This is always correct as
+// all VM state is global, so the guess only affects speed. It doubles the
+// size of the output, so it is only done with -native_funcs 1.
+static bool c_native_funcs;
+static int c_num_pcs;
+static bool* c_is_call;
+static bool* c_is_entry;
+static bool* c_is_target;
+static int c_func_start;
+static int c_func_end;
+
+static void c_analyze_funcs(Module* module) {
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    c_num_pcs = inst->pc + 1;
+  }
+  c_is_call = calloc(c_num_pcs + 1, sizeof(bool));
+  c_is_entry = calloc(c_num_pcs + 1, sizeof(bool));
+  c_is_target = calloc(c_num_pcs + 1, sizeof(bool));
+
+  bool has_ret_addr = false;
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      has_ret_addr = false;
+    }
+    prev_pc = inst->pc;
+    if (inst->op == MOV && inst->src.type == IMM &&
+        inst->src.imm == inst->pc + 1) {
+      has_ret_addr = true;
+    }
+    if (inst->op < JEQ || inst->op > JMP) {
+      continue;
+    }
+    if (inst->op == JMP && has_ret_addr) {
+      c_is_call[inst->pc] = true;
+    }
+    if (c_is_call[inst->pc] && inst->jmp.type == IMM &&
+        inst->jmp.imm >= 0 && inst->jmp.imm < c_num_pcs) {
+      c_is_entry[inst->jmp.imm] = true;
+    }
+  }
+
+  for (Label* label = module->labels; label; label = label->next) {
+    if (label->name[0] != '.' && label->pc < c_num_pcs) {
+      c_is_entry[label->pc] = true;
+    }
+  }
+
+  // Only jumps which stay in their function need a label.
+  int* func_of = malloc(sizeof(int) * c_num_pcs);
+  int func = -1;
+  for (int pc = 0; pc < c_num_pcs; pc++) {
+    if (c_is_entry[pc]) {
+      func = pc;
+    }
+    func_of[pc] = func;
+  }
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (inst->op >= JEQ && inst->op <= JMP && !c_is_call[inst->pc] &&
+        inst->jmp.type == IMM &&
+        inst->jmp.imm >= 0 && inst->jmp.imm < c_num_pcs &&
+        func_of[inst->jmp.imm] == func_of[inst->pc]) {
+      c_is_target[inst->jmp.imm] = true;
+    }
+  }
+  free(func_of);
+}
+
+static void c_emit_call(Inst* inst, const char* fallback_fmt) {
+  if (inst->jmp.type == IMM) {
+    emit_line("native%d(%d);", inst->jmp.imm, inst->pc + 1);
+    return;
+  }
+  const char* r = reg_names[inst->jmp.reg];
+  emit_line("if (%s < %d && native[%s]) native[%s](%d);",
+            r, c_num_pcs, r, r, inst->pc + 1);
+  emit_line("else");
+  inc_indent();
+  emit_line(fallback_fmt, r);
+  dec_indent();
 }
 
 static void c_emit_func_prologue(int func_id) {
@@ -60,11 +175,14 @@ static void c_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s];", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = mem[%s];", reg_names[inst->dst.reg],
+              mem_index_str(src_str(inst), c_mem_bits));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("mem[%s] = %s;",
+              mem_index_str(src_str(inst), c_mem_bits),
+              reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -100,8 +218,12 @@ static void c_emit_inst(Inst* inst) {
   case JLE:
   case JGE:
   case JMP:
-    emit_line("if (%s) pc = %s - 1;",
-              cmp_str(inst, "1"), value_str(&inst->jmp));
+    if (c_is_call && c_is_call[inst->pc]) {
+      c_emit_call(inst, "pc = %s - 1;");
+    } else {
+      emit_line("if (%s) pc = %s - 1;",
+                cmp_str(inst, "1"), value_str(&inst->jmp));
+    }
     break;
 
   default:
@@ -109,8 +231,85 @@ static void c_emit_inst(Inst* inst) {
   }
 }
 
+static void c_native_emit_inst(Inst* inst) {
+  switch (inst->op) {
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+  case JMP:
+    if (c_is_call[inst->pc]) {
+      c_emit_call(inst, "escape(%s);");
+    } else if (inst->jmp.type == REG) {
+      const char* r = reg_names[inst->jmp.reg];
+      emit_line("if (%s) {", cmp_str(inst, "1"));
+      emit_line(" if (%s == ret) return;", r);
+      emit_line(" escape(%s);", r);
+      emit_line("}");
+    } else if (c_func_start <= inst->jmp.imm && inst->jmp.imm < c_func_end) {
+      emit_line("if (%s) goto L%d;", cmp_str(inst, "1"), inst->jmp.imm);
+    } else {
+      emit_line("if (%s) escape(%d);", cmp_str(inst, "1"), inst->jmp.imm);
+    }
+    break;
+
+  default:
+    c_emit_inst(inst);
+  }
+}
+
+static void c_emit_native_funcs(Module* module) {
+  emit_line("");
+  emit_line("#include <setjmp.h>");
+  emit_line("jmp_buf escape_buf;");
+  emit_line("void escape(unsigned int target) {");
+  emit_line(" pc = target;");
+  emit_line(" longjmp(escape_buf, 1);");
+  emit_line("}");
+  emit_line("");
+  for (int pc = 0; pc < c_num_pcs; pc++) {
+    if (c_is_entry[pc]) {
+      emit_line("void native%d(unsigned int ret);", pc);
+    }
+  }
+  emit_line("void (*native[%d])(unsigned int);", c_num_pcs);
+
+  Inst* inst = module->text;
+  while (inst && !c_is_entry[inst->pc]) {
+    inst = inst->next;
+  }
+  while (inst) {
+    c_func_start = inst->pc;
+    c_func_end = c_func_start + 1;
+    while (c_func_end < c_num_pcs && !c_is_entry[c_func_end]) {
+      c_func_end++;
+    }
+
+    emit_line("");
+    emit_line("void native%d(unsigned int ret) {", c_func_start);
+    inc_indent();
+    int prev_pc = -1;
+    for (; inst && inst->pc < c_func_end; inst = inst->next) {
+      if (prev_pc != inst->pc && c_is_target[inst->pc]) {
+        emit_line("L%d:", inst->pc);
+      }
+      prev_pc = inst->pc;
+      c_native_emit_inst(inst);
+    }
+    emit_line("escape(%d);", c_func_end);
+    dec_indent();
+    emit_line("}");
+  }
+}
+
 void target_c(Module* module) {
-  c_init_state();
+  c_init_state(module->data);
+  if (c_native_funcs) {
+    c_analyze_funcs(module);
+    c_emit_native_funcs(module);
+  }
 
   int num_funcs = emit_chunked_main_loop(module->text,
                                          c_emit_func_prologue,
@@ -120,15 +319,17 @@ void target_c(Module* module) {
 
   emit_line("int main() {");
   inc_indent();
+  c_emit_mem_init(module->data);
 
-  Data* data = module->data;
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("mem[%d] = %d;", mp, data->v);
+  if (c_native_funcs) {
+    for (int pc = 0; pc < c_num_pcs; pc++) {
+      if (c_is_entry[pc]) {
+        emit_line("native[%d] = native%d;", pc, pc);
+      }
     }
+    emit_line("");
+    emit_line("setjmp(escape_buf);");
   }
-
-  emit_line("");
   emit_line("while (1) {");
   inc_indent();
   emit_line("switch (pc / %d | 0) {", CHUNKED_FUNC_SIZE);
@@ -145,3 +346,83 @@ void target_c(Module* module) {
   dec_indent();
   emit_line("}");
 }
+
+bool handle_c_args(const char* key, const char* value) {
+  if (!strcmp(key, "native_funcs")) {
+    c_native_funcs = parse_bool_value(value);
+    return true;
+  }
+  return handle_mem_budget_arg(key, value);
+}
+
+static int c_goto_num_pcs;
+
+static void c_goto_emit_inst(Inst* inst) {
+  switch (inst->op) {
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+  case JMP:
+    if (inst->jmp.type == REG) {
+      // A pc past the end goes to the label after the last pc, which
+      // exits.
+      const char* r = reg_names[inst->jmp.reg];
+      emit_line("if (%s) goto *labels[%s < %d ? %s : %d];",
+                cmp_str(inst, "1"), r, c_goto_num_pcs, r, c_goto_num_pcs);
+    } else {
+      emit_line("if (%s) goto L%d;", cmp_str(inst, "1"), inst->jmp.imm);
+    }
+    break;
+
+  default:
+    c_emit_inst(inst);
+  }
+}
+
+// Emits the whole program as a single function. Every pc becomes a label,
+// direct jumps become gotos, and register jumps go through a table of
+// label addresses (GNU C labels as values). Registers are locals so the C
+// compiler can keep them in machine registers.
+void target_c_goto(Module* module) {
+  emit_line("#include <stdio.h>");
+  emit_line("#include <stdlib.h>");
+  emit_line("#include <string.h>");
+  c_emit_mem(module->data);
+  emit_line("");
+  emit_line("int main() {");
+  inc_indent();
+  for (int i = 0; i < 6; i++) {
+    emit_line("unsigned int %s = 0;", reg_names[i]);
+  }
+  c_emit_mem_init(module->data);
+
+  int num_pcs = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    num_pcs = inst->pc + 1;
+  }
+  c_goto_num_pcs = num_pcs;
+  emit_line("static void* const labels[] = {");
+  for (int pc = 0; pc <= num_pcs; pc++) {
+    emit_line(" &&L%d,", pc);
+  }
+  emit_line("};");
+
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      emit_line("");
+      emit_line("L%d:", inst->pc);
+    }
+    prev_pc = inst->pc;
+    c_goto_emit_inst(inst);
+  }
+
+  emit_line("");
+  emit_line("L%d:", num_pcs);
+  emit_line("return 0;");
+  dec_indent();
+  emit_line("}");
+}
@@ -1,51 +1,89 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// The program runs at compile time in segments of at most SEGMENT_PCS pcs,
+// each of which is a separate constant evaluation that starts from the
+// State the previous one ended with. So the compiler's per-evaluation step
+// limits bound a segment rather than the whole run. A segment also ends
+// before its BUF_SIZE bytes of output could overflow, so the output grows
+// with the number of segments the program needs.
 size_t BUF_SIZE = 10000;
+static const int CPP_SEGMENT_PCS = 100000;
+
+static int cpp_mem_bits = 24;
+
+static void cpp_defs(Module* module) {
+  int max_putc = 0;
+  int num_putc = 0;
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      num_putc = 0;
+    }
+    prev_pc = inst->pc;
+    if (inst->op == PUTC && ++num_putc > max_putc) {
+      max_putc = num_putc;
+    }
+  }
 
-static void cpp_defs(void) {
   emit_line("#include <cstdio>");
-  emit_line("#include <utility>");
   emit_line("");
-  emit_line("const size_t BUF_SIZE = %d;", BUF_SIZE);
+  // A segment runs at least one pc, so the buffer holds the PUTCs of any.
+  size_t buf_size = BUF_SIZE < (size_t)max_putc ? (size_t)max_putc : BUF_SIZE;
+  emit_line("const unsigned int BUF_SIZE = %d;", (int)buf_size);
+  emit_line("const unsigned int SEGMENT_PCS = %d;", CPP_SEGMENT_PCS);
+  emit_line("// The most PUTCs in one pc.");
+  emit_line("const unsigned int MAX_PUTC = %d;", max_putc);
   emit_line("");
   emit_line("constexpr char input[] =");
   emit_line("#include \"input.txt\"");
   emit_line(";");
   emit_line("");
-  emit_line("struct buffer {");
+  emit_line("struct State {");
+  for (int i = 0; i < 7; i++) {
+    emit_line(" unsigned int %s;", reg_names[i]);
+  }
+  emit_line(" unsigned int i_cur;");
+  emit_line(" bool running;");
+  cpp_mem_bits = mem_size_bits(module->data);
+  emit_line(" unsigned int mem[1<<%d];", cpp_mem_bits);
+  emit_line("};");
+  emit_line("");
+  emit_line("struct Output {");
   emit_line(" unsigned int size;");
-  emit_line(" unsigned int b[BUF_SIZE];");
+  emit_line(" unsigned char b[BUF_SIZE];");
   emit_line("};");
-  emit_line("template <size_t... I>");
-  emit_line("constexpr buffer make_buf_impl(unsigned int size, unsigned int* buf, std::index_sequence<I...>) {");
-  emit_line(" return buffer{size, {buf[I]...}};");
-  emit_line("}");
-  emit_line("constexpr buffer make_buf(unsigned int size, unsigned int* buf) {");
-  emit_line(" return make_buf_impl(size, buf, std::make_index_sequence<BUF_SIZE>{});");
+  emit_line("");
+  emit_line("struct Segment {");
+  emit_line(" State state;");
+  emit_line(" Output out;");
+  emit_line("};");
+  emit_line("");
+  emit_line("constexpr State init_state() {");
+  emit_line(" return State{0, 0, 0, 0, 0, 0, 0, 0, true, {");
+  emit_data_words(module->data);
+  emit_line(" }};");
   emit_line("}");
 }
 
-static void cpp_init_state(Data* data) {
-  for (int i = 0; i < 7; i++) {
-    emit_line("unsigned int %s = 0;", reg_names[i]);
-  }
-
-  emit_line("unsigned int i_cur = 0;");
+// Registers and cursors are locals of run(), loaded from and saved to the
+// State, as GCC evaluates them much faster than references into it.
+static void cpp_emit_prologue(void) {
+  emit_line("constexpr Segment run(const State& state) {");
+  inc_indent();
+  emit_line("Segment seg{state, {}};");
+  emit_line("State& s = seg.state;");
+  emit_line("unsigned char* buf = seg.out.b;");
   emit_line("unsigned int o_cur = 0;");
-  emit_line("unsigned int mem[1<<24] = {0};");
-  emit_line("unsigned int buf[BUF_SIZE] = {0};");
-
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("mem[%d] = %d;", mp, data->v);
-    }
+  emit_line("unsigned int i_cur = s.i_cur;");
+  emit_line("bool running = true;");
+  for (int i = 0; i < 7; i++) {
+    emit_line("unsigned int %s = s.%s;", reg_names[i], reg_names[i]);
   }
-}
-
-static void cpp_emit_prologue(void) {
   emit_line("");
-  emit_line("while (1) {");
+  emit_line("for (unsigned int n = 0;");
+  emit_line("     running && n < SEGMENT_PCS && o_cur + MAX_PUTC <= BUF_SIZE;");
+  emit_line("     n++) {");
   inc_indent();
   emit_line("switch (pc) {");
   emit_line("case 0:");
@@ -58,7 +96,13 @@ static void cpp_emit_epilogue(void) {
   emit_line("pc++;");
   dec_indent();
   emit_line("}");
-  emit_line("return make_buf(o_cur, buf);");
+  for (int i = 0; i < 7; i++) {
+    emit_line("s.%s = %s;", reg_names[i], reg_names[i]);
+  }
+  emit_line("s.i_cur = i_cur;");
+  emit_line("s.running = running;");
+  emit_line("seg.out.size = o_cur;");
+  emit_line("return seg;");
   dec_indent();
   emit_line("}");
 }
@@ -90,11 +134,14 @@ static void cpp_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s];", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = s.mem[%s];", reg_names[inst->dst.reg],
+              mem_index_str(src_str(inst), cpp_mem_bits));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("s.mem[%s] = %s;",
+              mem_index_str(src_str(inst), cpp_mem_bits),
+              reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -107,7 +154,10 @@ static void cpp_emit_inst(Inst* inst) {
     break;
 
   case EXIT:
-    emit_line("return make_buf(o_cur, buf);");
+    // Leaves the switch at once, so the rest of the pc does not run, and
+    // the loop stops as it checks running.
+    emit_line("running = false;");
+    emit_line("break;");
     break;
 
   case DUMP:
@@ -151,23 +201,35 @@ void cpp_emit_main_loop(Inst* inst) {
 }
 
 void target_cpp(Module* module) {
-  cpp_defs();
+  cpp_defs(module);
   emit_line("");
-  emit_line("constexpr buffer constexpr_main() {");
-  inc_indent();
 
-  cpp_init_state(module->data);
   cpp_emit_prologue();
   cpp_emit_main_loop(module->text);
   cpp_emit_epilogue();
 
   emit_line("");
-  emit_line("int main() {");
-  emit_line(" constexpr buffer buf = constexpr_main();");
-  emit_line(" constexpr unsigned int output_size = buf.size;");
+  emit_line("template <unsigned int N>");
+  emit_line("struct segment {");
+  emit_line(" static constexpr Segment result = run(segment<N - 1>::result.state);");
+  emit_line("};");
+  emit_line("template <>");
+  emit_line("struct segment<0> {");
+  emit_line(" static constexpr Segment result = run(init_state());");
+  emit_line("};");
   emit_line("");
-  emit_line(" for(int i = 0; i < output_size; ++i) {");
-  emit_line("  putchar(buf.b[i]);");
+  emit_line("// Only the output of each segment is used at run time, so the");
+  emit_line("// memory images stay in the compiler.");
+  emit_line("template <unsigned int N>");
+  emit_line("void print() {");
+  emit_line(" static constexpr Output out = segment<N>::result.out;");
+  emit_line(" fwrite(out.b, 1, out.size, stdout);");
+  emit_line(" if constexpr (segment<N>::result.state.running) {");
+  emit_line("  print<N + 1>();");
   emit_line(" }");
   emit_line("}");
+  emit_line("");
+  emit_line("int main() {");
+  emit_line(" print<0>();");
+  emit_line("}");
 }
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include <ir/ir.h>
 #include <target/util.h>
 #include <target/cpp_template_lib.h>
@@ -241,3 +243,158 @@ void target_cpp_template(Module* module) {
   dec_indent();
   emit_line("}");
 }
+
+// Runs the program in a constexpr interpreter instead of instantiating a
+// template per executed instruction. The text is a constexpr array of
+// instructions and memory is a std::array local to the interpreter, so
+// the compiler needs memory for the VM footprint rather than the trace.
+static const char* CPP_TEMPLATE_CONSTEXPR_OPS[LAST_OP] = {
+  "MOV", "ADD", "SUB", "LOAD", "STORE", "PUTC", "GETC", "EXIT",
+  "JEQ", "JNE", "JLT", "JGT", "JLE", "JGE", "JMP", "",
+  "EQ", "NE", "LT", "GT", "LE", "GE",
+};
+
+static const int CPP_TEMPLATE_CONSTEXPR_OUT_SIZE = 65536;
+
+static void cpp_template_constexpr_emit_text(Inst* text) {
+  int num_pcs = 0;
+  for (Inst* inst = text; inst; inst = inst->next) {
+    num_pcs = inst->pc + 1;
+  }
+
+  // pc_start has the index of the first instruction of each pc. The last
+  // entry is the EXIT appended to the text.
+  int* pc_start = malloc(sizeof(int) * (num_pcs + 1));
+  int num_starts = 0;
+  int n = 0;
+  emit_line("constexpr Inst text[] = {");
+  for (Inst* inst = text; inst; inst = inst->next) {
+    if (inst->op == DUMP) {
+      continue;
+    }
+    while (num_starts <= inst->pc) {
+      pc_start[num_starts++] = n;
+    }
+    emit_line(" {%s, %s, %s, %d, %s, %d},",
+              CPP_TEMPLATE_CONSTEXPR_OPS[inst->op],
+              inst->dst.type == REG ? reg_names[inst->dst.reg] : "a",
+              inst->src.type == IMM ? "true" : "false",
+              inst->src.type == IMM ? inst->src.imm : (int)inst->src.reg,
+              inst->jmp.type == IMM ? "true" : "false",
+              inst->jmp.type == IMM ? inst->jmp.imm : (int)inst->jmp.reg);
+    n++;
+  }
+  while (num_starts <= num_pcs) {
+    pc_start[num_starts++] = n;
+  }
+  emit_line(" {EXIT, a, false, 0, false, 0},");
+  emit_line("};");
+  emit_line("");
+
+  emit_line("constexpr unsigned pc_start[] = {");
+  for (int pc = 0; pc <= num_pcs; pc++) {
+    emit_line(" %d,", pc_start[pc]);
+  }
+  emit_line("};");
+  free(pc_start);
+}
+
+void target_cpp_template_constexpr(Module* module) {
+  emit_line("#include <array>");
+  emit_line("#include <cstdio>");
+  emit_line("");
+  emit_line("constexpr char input[] =");
+  emit_line("#include \"input.txt\"");
+  emit_line(";");
+  emit_line("");
+  emit_line("enum Op {");
+  emit_line(" MOV, ADD, SUB, LOAD, STORE, PUTC, GETC, EXIT,");
+  emit_line(" JEQ, JNE, JLT, JGT, JLE, JGE, JMP,");
+  emit_line(" EQ = 16, NE, LT, GT, LE, GE");
+  emit_line("};");
+  emit_line("enum Reg { a, b, c, d, bp, sp };");
+  emit_line("");
+  emit_line("struct Inst {");
+  emit_line(" Op op;");
+  emit_line(" Reg dst;");
+  emit_line(" bool src_imm;");
+  emit_line(" unsigned src;");
+  emit_line(" bool jmp_imm;");
+  emit_line(" unsigned jmp;");
+  emit_line("};");
+  emit_line("");
+  cpp_template_constexpr_emit_text(module->text);
+  emit_line("");
+
+  int bits = mem_size_bits(module->data);
+  emit_line("constexpr unsigned data[] = {");
+  emit_data_words(module->data);
+  emit_line(" 0");
+  emit_line("};");
+  emit_line("constexpr unsigned MEM_MASK = (1u << %d) - 1;", bits);
+  emit_line("constexpr unsigned OUT_SIZE = %d;",
+            CPP_TEMPLATE_CONSTEXPR_OUT_SIZE);
+  emit_line("");
+  emit_line("struct Output {");
+  emit_line(" unsigned size;");
+  emit_line(" std::array<unsigned char, OUT_SIZE> b;");
+  emit_line("};");
+  emit_line("");
+  emit_line("constexpr Output run() {");
+  inc_indent();
+  emit_line("std::array<unsigned, MEM_MASK + 1> mem{};");
+  emit_line("for (unsigned i = 0; i < sizeof(data) / sizeof(data[0]); i++)");
+  emit_line(" mem[i] = data[i];");
+  emit_line("unsigned r[6] = {};");
+  emit_line("unsigned in = 0;");
+  emit_line("Output out{};");
+  emit_line("for (unsigned i = 0;;) {");
+  inc_indent();
+  emit_line("const Inst& inst = text[i++];");
+  emit_line("unsigned src = inst.src_imm ? inst.src : r[inst.src];");
+  emit_line("unsigned& dst = r[inst.dst];");
+  emit_line("bool jump = false;");
+  emit_line("switch (inst.op) {");
+  emit_line("case MOV: dst = src; break;");
+  emit_line("case ADD: dst = (dst + src) & " UINT_MAX_STR "; break;");
+  emit_line("case SUB: dst = (dst - src) & " UINT_MAX_STR "; break;");
+  emit_line("case LOAD: dst = mem[src & MEM_MASK]; break;");
+  emit_line("case STORE: mem[src & MEM_MASK] = dst; break;");
+  emit_line("case PUTC:");
+  // Evaluating a throw fails the constant evaluation, so a longer output
+  // is a compile error rather than silently cut.
+  emit_line(" if (out.size == OUT_SIZE)");
+  emit_line("  throw \"output is longer than OUT_SIZE\";");
+  emit_line(" out.b[out.size++] = src;");
+  emit_line(" break;");
+  emit_line("case GETC:");
+  emit_line(" dst = input[in] ? (unsigned char)input[in++] : 0;");
+  emit_line(" break;");
+  emit_line("case EXIT: return out;");
+  emit_line("case EQ: dst = dst == src; break;");
+  emit_line("case NE: dst = dst != src; break;");
+  emit_line("case LT: dst = dst < src; break;");
+  emit_line("case GT: dst = dst > src; break;");
+  emit_line("case LE: dst = dst <= src; break;");
+  emit_line("case GE: dst = dst >= src; break;");
+  emit_line("case JEQ: jump = dst == src; break;");
+  emit_line("case JNE: jump = dst != src; break;");
+  emit_line("case JLT: jump = dst < src; break;");
+  emit_line("case JGT: jump = dst > src; break;");
+  emit_line("case JLE: jump = dst <= src; break;");
+  emit_line("case JGE: jump = dst >= src; break;");
+  emit_line("case JMP: jump = true; break;");
+  emit_line("}");
+  emit_line("if (jump)");
+  emit_line(" i = pc_start[inst.jmp_imm ? inst.jmp : r[inst.jmp]];");
+  dec_indent();
+  emit_line("}");
+  dec_indent();
+  emit_line("}");
+  emit_line("");
+  emit_line("constexpr Output output = run();");
+  emit_line("");
+  emit_line("int main() {");
+  emit_line(" fwrite(output.b.data(), 1, output.size, stdout);");
+  emit_line("}");
+}
@@ -9,11 +9,12 @@ static void cr_init_state(Data* data) {
   emit_line("{%% if flag?(:cr_elvm_input) %%}");
   emit_line(" print \"#{STDIN.each_byte.to_a.map(&.to_i32).inspect} of Int32\"");
   emit_line("{%% elsif flag?(:cr_elvm_output) %%}");
-  emit_line(" STDERR.write_byte ARGV[0].to_u8");
+  emit_line(" ARGV.each { |c| STDERR.write_byte c.to_u8 }");
   emit_line("{%% else %%}");
   inc_indent();
 
-  emit_line("STATE = {input: 0, exit: 0}");
+  emit_line("STATE = {input: 0, exit: 0, flushed: 0}");
+  emit_line("OUTPUT = [] of Int32");
   emit_line("");
 
   reg_names = CR_REG_NAMES;
@@ -34,6 +35,19 @@ static void cr_init_state(Data* data) {
   emit_line("{%% end %%}");
 }
 
+// Every write spawns a crystal process at compile time, so output bytes
+// are collected in OUTPUT and written CR_OUTPUT_CHUNK at a time, and
+// the rest at EXIT. Input is read up front, so reads never need a flush.
+static const int CR_OUTPUT_CHUNK = 16384;
+
+static void cr_emit_flush(void) {
+  emit_line("if OUTPUT.size > STATE[:flushed]");
+  emit_line(" `crystal run -D cr_elvm_output #{1.filename} -- "
+            "#{OUTPUT[STATE[:flushed]..-1].join(\" \")}`");
+  emit_line(" STATE[:flushed] = OUTPUT.size");
+  emit_line("end");
+}
+
 static void cr_emit_func_prologue(int func_id) {
   emit_line("{%% if %d <= REG[:pc] && REG[:pc] < %d %%}",
             func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
@@ -94,7 +108,12 @@ static void cr_emit_inst(Inst* inst) {
     break;
 
   case PUTC:
-    emit_line("`crystal run -D cr_elvm_output #{1.filename} -- #{%s & 255}`", src_str(inst));
+    emit_line("OUTPUT << (%s & 255)", src_str(inst));
+    emit_line("if OUTPUT.size - STATE[:flushed] >= %d", CR_OUTPUT_CHUNK);
+    inc_indent();
+    cr_emit_flush();
+    dec_indent();
+    emit_line("end");
     break;
 
   case GETC:
@@ -107,6 +126,7 @@ static void cr_emit_inst(Inst* inst) {
     break;
 
   case EXIT:
+    cr_emit_flush();
     emit_line("STATE[:exit] = 1");
     break;
 
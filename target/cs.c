@@ -1,6 +1,8 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+static int cs_mem_bits = 24;
+
 static void cs_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("private static void func%d() {", func_id);
@@ -51,11 +53,14 @@ static void cs_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s];", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = mem[%s];", reg_names[inst->dst.reg],
+              mem_index_str(src_str(inst), cs_mem_bits));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("mem[%s] = %s;",
+              mem_index_str(src_str(inst), cs_mem_bits),
+              reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -102,30 +107,12 @@ static void cs_emit_inst(Inst* inst) {
   }
 }
 
-static int cs_init_state(Data* data) {
-  int prev_mc = -1;
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      int mc = mp / 1000;
-      while (prev_mc != mc) {
-        if (prev_mc != -1) {
-          dec_indent();
-          emit_line("}");
-        }
-        prev_mc++;
-        emit_line("static void init%d() {", prev_mc);
-        inc_indent();
-      }
-      emit_line("mem[%d] = %d;", mp, data->v);
-    }
-  }
-
-  if (prev_mc != -1) {
-    dec_indent();
-    emit_line("}");
-  }
-
-  return prev_mc + 1;
+// Array initializers of constants are stored as a blob in the assembly
+// and copied in with a single call.
+static void cs_init_state(Data* data) {
+  emit_line("static readonly int[] memInit = {");
+  emit_data_words(data);
+  emit_line("};");
 }
 
 void target_cs(Module* module) {
@@ -137,11 +124,12 @@ void target_cs(Module* module) {
   for (int i = 0; i < 7; i++) {
     emit_line("static int %s;", reg_names[i]);
   }
-  emit_line("static int[] mem = new int[1<<24];");
+  cs_mem_bits = mem_size_bits(module->data);
+  emit_line("static int[] mem = new int[1<<%d];", cs_mem_bits);
 
-  int num_inits = cs_init_state(module->data);
+  cs_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 256;
+  set_default_chunked_func_size(256);
   int num_funcs = emit_chunked_main_loop(module->text,
                                          cs_emit_func_prologue,
                                          cs_emit_func_epilogue,
@@ -151,9 +139,7 @@ void target_cs(Module* module) {
   emit_line("public static void Main(string[] args) {");
   inc_indent();
 
-  for (int i = 0; i < num_inits; i++) {
-    emit_line("init%d();", i);
-  }
+  emit_line("Array.Copy(memInit, mem, memInit.Length);");
 
   emit_line("");
   emit_line("while (true) {");
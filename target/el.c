@@ -1,16 +1,39 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// 0 for the sparse memory, which is a hash table.
+static int el_mem_bits = 24;
+
+static const char* el_mem_index(const char* addr) {
+  if (el_mem_bits == 0 || el_mem_bits == 24)
+    return addr;
+  return format("(logand %s %d)", addr, (1 << el_mem_bits) - 1);
+}
+
 static void init_state_el(Data* data) {
   emit_line("(setq elvm-main (lambda ()");
   emit_line("(load \"cl\" nil t)");
   for (int i = 0; i < 7; i++) {
     emit_line("(setq %s 0)", reg_names[i]);
   }
-  emit_line("(setq mem (make-vector 16777216 0))");
+  if (use_sparse_mem()) {
+    el_mem_bits = 0;
+    emit_line("(setq mem (make-hash-table))");
+  } else {
+    el_mem_bits = mem_size_bits(data);
+    if (el_mem_bits == 24) {
+      emit_line("(setq mem (make-vector 16777216 0))");
+    } else {
+      emit_line("(setq mem (make-vector %d 0))", 1 << el_mem_bits);
+    }
+  }
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
-      emit_line("(aset mem %d %d)", mp, data->v);
+      if (el_mem_bits == 0) {
+        emit_line("(puthash %d %d mem)", mp, data->v);
+      } else {
+        emit_line("(aset mem %d %d)", mp, data->v);
+      }
     }
   }
 }
@@ -80,12 +103,22 @@ static void el_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("(setq %s (aref mem %s))",
-              reg_names[inst->dst.reg], src_str(inst));
+    if (el_mem_bits == 0) {
+      emit_line("(setq %s (gethash %s mem 0))",
+                reg_names[inst->dst.reg], src_str(inst));
+    } else {
+      emit_line("(setq %s (aref mem %s))",
+                reg_names[inst->dst.reg], el_mem_index(src_str(inst)));
+    }
     break;
 
   case STORE:
-    emit_line("(aset mem %s %s)", src_str(inst), reg_names[inst->dst.reg]);
+    if (el_mem_bits == 0) {
+      emit_line("(puthash %s %s mem)", src_str(inst), reg_names[inst->dst.reg]);
+    } else {
+      emit_line("(aset mem %s %s)",
+                el_mem_index(src_str(inst)), reg_names[inst->dst.reg]);
+    }
     break;
 
   case PUTC:
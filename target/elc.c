@@ -2,6 +2,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if !defined(NOFILE) && !defined(__eir__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
 #include <ir/ir.h>
 #include <target/util.h>
 
@@ -11,10 +22,12 @@ void target_awk(Module* module);
 void target_bef(Module* module);
 void target_bf(Module* module);
 void target_c(Module* module);
+void target_c_goto(Module* module);
 void target_cl(Module* module);
 void target_cmake(Module* module);
 void target_cpp(Module* module);
 void target_cpp_template(Module* module);
+void target_cpp_template_constexpr(Module* module);
 void target_cr(Module* module);
 void target_cs(Module* module);
 void target_el(Module* module);
@@ -25,6 +38,7 @@ void target_fs(Module* module);
 void target_go(Module* module);
 void target_hell(Module* module);
 void target_hs(Module* module);
+void target_hs_strict(Module* module);
 void target_i(Module* module);
 void target_j(Module* module);
 void target_java(Module* module);
@@ -32,6 +46,7 @@ void target_js(Module* module);
 void target_kx(Module* module);
 void target_lua(Module* module);
 void target_ll(Module* module);
+void target_ll_ssa(Module* module);
 void target_lol(Module* module);
 void target_mcfunction(Module* module);
 void target_oct(Module* module);
@@ -58,7 +73,9 @@ void target_tm(Module* module);
 void target_unl(Module* module);
 void target_vim(Module* module);
 void target_wasi(Module* module);
+void target_wasi_bin(Module* module);
 void target_wasm(Module* module);
+void target_wasm_bin(Module* module);
 void target_whirl(Module* module);
 void target_wm(Module* module);
 void target_ws(Module* module);
@@ -66,20 +83,27 @@ void target_x86(Module* module);
 
 typedef void (*target_func_t)(Module*);
 
-static target_func_t get_target_func(const char* ext) {
+// These backends need the module loaded with split_basic_block_by_mem.
+static bool splits_basic_block_by_mem(const char* ext) {
+  return !strcmp(ext, "bf") || !strcmp(ext, "wm");
+}
+
+// Returns NULL for an unknown target.
+static target_func_t find_target_func(const char* ext) {
   if (!strcmp(ext, "arm")) return target_arm;
   if (!strcmp(ext, "asmjs")) return target_asmjs;
   if (!strcmp(ext, "awk")) return target_awk;
   if (!strcmp(ext, "bef")) return target_bef;
-  if (!strcmp(ext, "bf")) {
-    split_basic_block_by_mem();
-    return target_bf;
-  }
+  if (!strcmp(ext, "bf")) return target_bf;
   if (!strcmp(ext, "c")) return target_c;
+  if (!strcmp(ext, "c_goto")) return target_c_goto;
   if (!strcmp(ext, "cl")) return target_cl;
   if (!strcmp(ext, "cmake")) return target_cmake;
   if (!strcmp(ext, "cpp")) return target_cpp;
   if (!strcmp(ext, "cpp_template")) return target_cpp_template;
+  if (!strcmp(ext, "cpp_template_constexpr")) {
+    return target_cpp_template_constexpr;
+  }
   if (!strcmp(ext, "cr")) return target_cr;
   if (!strcmp(ext, "cs")) return target_cs;
   if (!strcmp(ext, "el")) return target_el;
@@ -90,6 +114,7 @@ static target_func_t get_target_func(const char* ext) {
   if (!strcmp(ext, "go")) return target_go;
   if (!strcmp(ext, "hell")) return target_hell;
   if (!strcmp(ext, "hs")) return target_hs;
+  if (!strcmp(ext, "hs_strict")) return target_hs_strict;
   if (!strcmp(ext, "i")) return target_i;
   if (!strcmp(ext, "j")) return target_j;
   if (!strcmp(ext, "java")) return target_java;
@@ -97,6 +122,7 @@ static target_func_t get_target_func(const char* ext) {
   if (!strcmp(ext, "kx")) return target_kx;
   if (!strcmp(ext, "lua")) return target_lua;
   if (!strcmp(ext, "ll")) return target_ll;
+  if (!strcmp(ext, "ll_ssa")) return target_ll_ssa;
   if (!strcmp(ext, "lol")) return target_lol;
   if (!strcmp(ext, "mcfunction")) return target_mcfunction;
   if (!strcmp(ext, "oct")) return target_oct;
@@ -123,27 +149,489 @@ static target_func_t get_target_func(const char* ext) {
   if (!strcmp(ext, "unl")) return target_unl;
   if (!strcmp(ext, "vim")) return target_vim;
   if (!strcmp(ext, "wasi")) return target_wasi;
+  if (!strcmp(ext, "wasi_bin")) return target_wasi_bin;
   if (!strcmp(ext, "wasm")) return target_wasm;
+  if (!strcmp(ext, "wasm_bin")) return target_wasm_bin;
   if (!strcmp(ext, "whirl")) return target_whirl;
-  if (!strcmp(ext, "wm")) {
-    split_basic_block_by_mem();
-    return target_wm;
-  }
+  if (!strcmp(ext, "wm")) return target_wm;
   if (!strcmp(ext, "ws")) return target_ws;
   if (!strcmp(ext, "x86")) return target_x86;
-  error("unknown flag: %s", ext);
+  return NULL;
 }
 
+static target_func_t get_target_func(const char* ext) {
+  target_func_t target_func = find_target_func(ext);
+  if (!target_func) {
+    error("unknown flag: %s", ext);
+  }
+  if (splits_basic_block_by_mem(ext)) {
+    split_basic_block_by_mem();
+  }
+  return target_func;
+}
+
+bool handle_arm_args(const char* arg, const char* value);
+bool handle_c_args(const char* arg, const char* value);
 bool handle_mcfunction_args(const char* arg, const char* value);
 
 typedef bool (*handle_args_func_t)(const char*, const char*);
 
+// Backends which split the program into functions of CHUNKED_FUNC_SIZE
+// pcs, and so accept -chunked_func_size.
+static const char* CHUNKED_TARGETS[] = {
+  "asmjs", "awk", "c", "cl", "cmake", "cr", "cs", "desmos", "el", "f90",
+  "forth", "fs", "hs", "hs_strict", "j", "java", "js", "kx", "ll", "lol",
+  "lua", "oct", "php", "ps", "py", "qftasm", "rb", "rs", "scala",
+  "sqlite3", "swift", "tcl", "vim", "wasi", "wasi_bin", "wasm", "wasm_bin",
+  NULL
+};
+
+static bool is_chunked_target(const char* ext) {
+  for (int i = 0; CHUNKED_TARGETS[i]; i++) {
+    if (!strcmp(ext, CHUNKED_TARGETS[i])) return true;
+  }
+  return false;
+}
+
 static handle_args_func_t get_handle_args_func(const char* ext) {
   if (!strcmp(ext, "mcfunction")) return handle_mcfunction_args;
-  if (!strcmp(ext, "rb")) return handle_chunked_func_size_arg;
+  if (!strcmp(ext, "arm")) return handle_arm_args;
+  if (!strcmp(ext, "x86")) return handle_elf_args;
+  if (!strcmp(ext, "c")) return handle_c_args;
+  if (!strcmp(ext, "c_goto") || !strcmp(ext, "cpp") ||
+      !strcmp(ext, "cpp_template_constexpr") || !strcmp(ext, "cs") ||
+      !strcmp(ext, "java")) {
+    return handle_mem_budget_arg;
+  }
+  if (!strcmp(ext, "el") || !strcmp(ext, "lua") || !strcmp(ext, "py") ||
+      !strcmp(ext, "rb") || !strcmp(ext, "vim")) {
+    return handle_sparse_mem_args;
+  }
   return NULL;
 }
 
+#if !defined(NOFILE) && !defined(__eir__)
+
+static bool handle_target_arg(const char* ext,
+                              const char* key, const char* value) {
+  if (is_chunked_target(ext) && handle_chunked_func_size_arg(key, value)) {
+    return true;
+  }
+  handle_args_func_t handle_args = get_handle_args_func(ext);
+  return handle_args && handle_args(key, value);
+}
+
+// A cache of outputs for -cache DIR. An entry is named by a hash of
+// everything the output depends on: the elc binary, the EIR bytes, the
+// target and its flags. Hits refresh the mtime of the entry, and the
+// least recently used entries are evicted once the cache grows over
+// g_cache_max_bytes. DIR/stats holds the numbers of hits and misses,
+// updated under flock as elc runs may share the cache.
+
+static const char* g_cache_dir;
+static long long g_cache_max_bytes = 256LL << 20;
+static uint64_t g_cache_input_hash;
+
+static uint64_t hash_bytes(uint64_t h, const void* p, size_t n) {
+  const unsigned char* b = p;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ b[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint64_t hash_str(uint64_t h, const char* s) {
+  return hash_bytes(h, s, strlen(s) + 1);
+}
+
+static bool hash_file(uint64_t* h, const char* path) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return false;
+  }
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    *h = hash_bytes(*h, buf, n);
+  }
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+static void copy_stream(FILE* from, FILE* to) {
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), from)) > 0) {
+    if (fwrite(buf, 1, n, to) != n) {
+      error("write failed");
+    }
+  }
+}
+
+static bool copy_file(const char* from, FILE* to) {
+  FILE* fp = fopen(from, "rb");
+  if (!fp) {
+    return false;
+  }
+  copy_stream(fp, to);
+  fclose(fp);
+  return true;
+}
+
+// Copies |from| to |path| through a temporary file, so readers never
+// see a partial file.
+static bool copy_file_to_path(const char* from, const char* path) {
+  FILE* in = fopen(from, "rb");
+  if (!in) {
+    return false;
+  }
+  char* tmp_path = format("%s.%d.tmp", path, (int)getpid());
+  FILE* out = fopen(tmp_path, "wb");
+  if (!out) {
+    error("cannot open %s", tmp_path);
+  }
+  copy_stream(in, out);
+  fclose(in);
+  if (fclose(out) || rename(tmp_path, path)) {
+    error("cannot write %s", path);
+  }
+  return true;
+}
+
+// The cache only keeps stdout, so outputs which come with other files,
+// such as the -perf_map of the ELF backends, are not cached.
+static bool has_side_file_args(char** args, int num_args) {
+  for (int i = 0; i < num_args; i += 2) {
+    if (!strcmp(args[i], "-perf_map")) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Keys the cache on the elc binary, as the output of every backend is
+// linked into it. Without a way to read it the cache is disabled.
+static void cache_init(const char* dir, const char* argv0,
+                       const char* filename) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  if (!hash_file(&h, "/proc/self/exe") && !hash_file(&h, argv0)) {
+    fprintf(stderr, "elc: cannot read the elc binary, not caching\n");
+    return;
+  }
+  if (!hash_file(&h, filename)) {
+    return;
+  }
+  mkdir(dir, 0777);
+  g_cache_dir = dir;
+  g_cache_input_hash = h;
+}
+
+static char* cache_path(const char* ext, char** args, int num_args) {
+  uint64_t h = hash_str(g_cache_input_hash, ext);
+  for (int i = 0; i < num_args; i++) {
+    h = hash_str(h, args[i]);
+  }
+  const char* cmake_prefix = getenv("ELVM_CMAKE_PREFIX");
+  if (!strcmp(ext, "cmake") && cmake_prefix) {
+    h = hash_str(h, cmake_prefix);
+  }
+  return format("%s/%016llx", g_cache_dir, (unsigned long long)h);
+}
+
+// Reads "HITS MISSES" from the locked |fd|.
+static void cache_read_stats(int fd, long long* hits, long long* misses) {
+  char buf[64];
+  int len = pread(fd, buf, sizeof(buf) - 1, 0);
+  buf[len > 0 ? len : 0] = 0;
+  *hits = *misses = 0;
+  sscanf(buf, "%lld %lld", hits, misses);
+}
+
+static void cache_count(bool hit) {
+  int fd = open(format("%s/stats", g_cache_dir), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    return;
+  }
+  // Counts only grow, so the new line covers the old one.
+  if (!flock(fd, LOCK_EX)) {
+    long long hits, misses;
+    cache_read_stats(fd, &hits, &misses);
+    *(hit ? &hits : &misses) += 1;
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%lld %lld\n", hits, misses);
+    if (pwrite(fd, buf, len, 0) != len) {
+      // Statistics are best effort.
+    }
+  }
+  close(fd);
+}
+
+static bool is_cache_entry(const char* name) {
+  int len = strlen(name);
+  if (len != 16) {
+    return false;
+  }
+  for (int i = 0; i < len; i++) {
+    if (!strchr("0123456789abcdef", name[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+typedef struct {
+  char* path;
+  long long size;
+  time_t mtime;
+} CacheEntry;
+
+static int cmp_cache_entry(const void* a, const void* b) {
+  time_t ta = ((const CacheEntry*)a)->mtime;
+  time_t tb = ((const CacheEntry*)b)->mtime;
+  return ta < tb ? -1 : ta > tb;
+}
+
+// Returns the total size of the entries and, if |entries| is not NULL,
+// the entries themselves. Also removes temporary files a killed elc
+// left behind a day ago or earlier.
+static long long cache_scan(CacheEntry** entries, int* num_entries) {
+  DIR* dir = opendir(g_cache_dir);
+  if (!dir) {
+    return 0;
+  }
+  long long total = 0;
+  int cap = 16;
+  int num = 0;
+  CacheEntry* r = malloc(sizeof(CacheEntry) * cap);
+  time_t now = time(NULL);
+  struct dirent* ent;
+  while ((ent = readdir(dir))) {
+    char* path = format("%s/%s", g_cache_dir, ent->d_name);
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    const char* dot = strrchr(ent->d_name, '.');
+    if (dot && !strcmp(dot, ".tmp") && st.st_mtime + 86400 < now) {
+      unlink(path);
+      continue;
+    }
+    if (!is_cache_entry(ent->d_name)) {
+      continue;
+    }
+    if (num == cap) {
+      cap *= 2;
+      r = realloc(r, sizeof(CacheEntry) * cap);
+    }
+    r[num].path = path;
+    r[num].size = st.st_size;
+    r[num].mtime = st.st_mtime;
+    num++;
+    total += st.st_size;
+  }
+  closedir(dir);
+  if (entries) {
+    *entries = r;
+    *num_entries = num;
+  }
+  return total;
+}
+
+static void cache_evict() {
+  CacheEntry* entries;
+  int num_entries;
+  long long total = cache_scan(&entries, &num_entries);
+  if (total <= g_cache_max_bytes) {
+    return;
+  }
+  qsort(entries, num_entries, sizeof(CacheEntry), cmp_cache_entry);
+  for (int i = 0; i < num_entries && total > g_cache_max_bytes; i++) {
+    if (!unlink(entries[i].path)) {
+      total -= entries[i].size;
+    }
+  }
+}
+
+static void cache_print_stats() {
+  int num_entries;
+  CacheEntry* entries;
+  long long total = cache_scan(&entries, &num_entries);
+  long long hits = 0;
+  long long misses = 0;
+  int fd = open(format("%s/stats", g_cache_dir), O_RDONLY);
+  if (fd >= 0) {
+    if (!flock(fd, LOCK_SH)) {
+      cache_read_stats(fd, &hits, &misses);
+    }
+    close(fd);
+  }
+  printf("hits: %lld\n", hits);
+  printf("misses: %lld\n", misses);
+  if (hits + misses) {
+    printf("hit rate: %.1f%%\n", 100.0 * hits / (hits + misses));
+  }
+  printf("entries: %d\n", num_entries);
+  printf("bytes: %lld (max %lld)\n", total, g_cache_max_bytes);
+}
+
+// Writes the cached output for |key| to |path|, or to stdout if |path|
+// is NULL.
+static bool cache_get(const char* key, const char* path) {
+  bool hit = path ? copy_file_to_path(key, path) : copy_file(key, stdout);
+  if (hit) {
+    utime(key, NULL);
+  }
+  cache_count(hit);
+  return hit;
+}
+
+static void cache_put(const char* key, const char* path) {
+  copy_file_to_path(path, key);
+  cache_evict();
+}
+
+// Runs in a child of emit_targets. |args| are the flags given after
+// -targets, and each backend takes the ones it knows.
+static void emit_target(Module* module, const char* filename,
+                        const char* ext, const char* path,
+                        char** args, int num_args) {
+  target_func_t target_func = get_target_func(ext);
+  if (splits_basic_block_by_mem(ext)) {
+    module = load_eir_from_file(filename);
+  }
+  for (int i = 0; i + 1 < num_args; i += 2) {
+    handle_target_arg(ext, args[i] + 1, args[i + 1]);
+  }
+
+  char* tmp_path = format("%s.tmp", path);
+  if (!freopen(tmp_path, "w", stdout)) {
+    error("cannot open %s", tmp_path);
+  }
+  setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+  target_func(module);
+  if (fclose(stdout) || rename(tmp_path, path)) {
+    error("cannot write %s", path);
+  }
+  if (g_cache_dir) {
+    cache_put(cache_path(ext, args, num_args), path);
+  }
+}
+
+// Fails unless each flag in |args| is taken by one of |exts| at least.
+// The handlers set the globals of the backends, which the children must
+// not inherit, so the check runs in a child of its own.
+static void check_target_args(char** exts, int num_exts,
+                              char** args, int num_args) {
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    error("fork failed");
+  }
+  if (pid == 0) {
+    for (int i = 0; i + 1 < num_args; i += 2) {
+      bool taken = false;
+      for (int j = 0; j < num_exts && !taken; j++) {
+        taken = handle_target_arg(exts[j], args[i] + 1, args[i + 1]);
+      }
+      if (!taken) {
+        error("unknown flag: %s", args[i]);
+      }
+    }
+    exit(0);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0 ||
+      !WIFEXITED(status) || WEXITSTATUS(status)) {
+    exit(1);
+  }
+}
+
+// Emits each target in the comma separated |targets| to
+// OUTDIR/BASENAME.TARGET, loading the module only once, and not at all
+// if every target is in the cache. Backends keep their state in globals
+// and some modify the module, so every target runs in a forked process,
+// at most |jobs| at a time.
+static void emit_targets(const char* filename,
+                         const char* targets, const char* outdir, int jobs,
+                         char** args, int num_args) {
+  const char* base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+
+  int num_exts = 1;
+  for (const char* p = targets; *p; p++) {
+    num_exts += *p == ',';
+  }
+  char** exts = malloc(sizeof(char*) * num_exts);
+  pid_t* pids = malloc(sizeof(pid_t) * num_exts);
+  num_exts = 0;
+  for (char* ext = strtok(strdup(targets), ","); ext;
+       ext = strtok(NULL, ",")) {
+    if (!find_target_func(ext)) {
+      error("unknown target: %s", ext);
+    }
+    exts[num_exts++] = ext;
+  }
+  check_target_args(exts, num_exts, args, num_args);
+
+  if (g_cache_dir) {
+    int num_missed = 0;
+    for (int i = 0; i < num_exts; i++) {
+      if (!cache_get(cache_path(exts[i], args, num_args),
+                     format("%s/%s.%s", outdir, base, exts[i]))) {
+        exts[num_missed++] = exts[i];
+      }
+    }
+    num_exts = num_missed;
+  }
+  if (!num_exts) {
+    return;
+  }
+  Module* module = load_eir_from_file(filename);
+
+  fflush(stdout);
+  fflush(stderr);
+  int num_failed = 0;
+  int num_running = 0;
+  for (int i = 0; i < num_exts || num_running; ) {
+    if (i < num_exts && num_running < jobs) {
+      pids[i] = fork();
+      if (pids[i] < 0) {
+        error("fork failed");
+      }
+      if (pids[i] == 0) {
+        char* path = format("%s/%s.%s", outdir, base, exts[i]);
+        emit_target(module, filename, exts[i], path, args, num_args);
+        exit(0);
+      }
+      i++;
+      num_running++;
+      continue;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      error("wait failed");
+    }
+    num_running--;
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      for (int j = 0; j < i; j++) {
+        if (pids[j] == pid) {
+          fprintf(stderr, "elc: %s failed\n", exts[j]);
+        }
+      }
+      num_failed++;
+    }
+  }
+  if (num_failed) {
+    exit(1);
+  }
+}
+
+#endif
+
 int main(int argc, char* argv[]) {
 #if defined(NOFILE) || defined(__eir__)
   char buf[32];
@@ -158,17 +646,53 @@ int main(int argc, char* argv[]) {
   target_func_t target_func = get_target_func(buf);
   Module* module = load_eir(stdin);
 #else
+  // emit_line writes a line at a time, so a big buffer saves syscalls.
+  setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
   target_func_t target_func = NULL;
   const char* ext = NULL;
   const char* filename = NULL;
+  // elc -targets c,js,py [-outdir DIR] [-jobs N] [target flags] input.eir
+  const char* targets = NULL;
+  const char* outdir = ".";
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  // elc -cache DIR [-cache_max_mb N] [-cache_stats] ..., or ELC_CACHE_DIR
+  const char* cache_dir = getenv("ELC_CACHE_DIR");
+  bool cache_stats = false;
+  char** target_args = malloc(sizeof(char*) * argc);
+  int num_target_args = 0;
   for (int i = 1; i < argc; i++) {
     const char* arg = argv[i];
     if (arg[0] == '-') {
-      if (target_func) {
-        handle_args_func_t handle_args = get_handle_args_func(ext);
-        if (!handle_args || !handle_args(arg + 1, argv[++i])) {
+      if (!strcmp(arg, "-cache") && i + 1 < argc) {
+        cache_dir = argv[++i];
+      } else if (!strcmp(arg, "-cache_max_mb") && i + 1 < argc) {
+        g_cache_max_bytes = atoll(argv[++i]) << 20;
+        if (g_cache_max_bytes <= 0) {
+          error("cache_max_mb must be positive: %s", argv[i]);
+        }
+      } else if (!strcmp(arg, "-cache_stats")) {
+        cache_stats = true;
+      } else if (!target_func && !strcmp(arg, "-targets") && i + 1 < argc) {
+        targets = argv[++i];
+      } else if (targets && !strcmp(arg, "-outdir") && i + 1 < argc) {
+        outdir = argv[++i];
+      } else if (targets && !strcmp(arg, "-jobs") && i + 1 < argc) {
+        jobs = atoi(argv[++i]);
+        if (jobs <= 0) {
+          error("jobs must be positive: %s", argv[i]);
+        }
+      } else if (targets && i + 1 < argc) {
+        target_args[num_target_args++] = argv[i];
+        target_args[num_target_args++] = argv[++i];
+      } else if (target_func) {
+        if (!handle_target_arg(ext, arg + 1, argv[++i])) {
           error("unknown flag");
         }
+        target_args[num_target_args++] = argv[i - 1];
+        target_args[num_target_args++] = argv[i];
+      } else if (targets) {
+        error("unknown flag");
       } else {
         ext = arg + 1;
         target_func = get_target_func(ext);
@@ -178,14 +702,65 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  if (cache_stats) {
+    if (!cache_dir) {
+      error("no cache directory");
+    }
+    g_cache_dir = cache_dir;
+    cache_print_stats();
+    return 0;
+  }
   if (!filename) {
     error("no input file");
   }
+  if (cache_dir && !has_side_file_args(target_args, num_target_args)) {
+    cache_init(cache_dir, argv[0], filename);
+  }
+  if (targets) {
+    emit_targets(filename, targets, outdir, jobs <= 0 ? 1 : jobs,
+                 target_args, num_target_args);
+    return 0;
+  }
   if (!target_func) {
     error("no target");
   }
 
+  // On a miss the output goes to a temporary file in the cache first and
+  // then to the real stdout.
+  char* cache_key = NULL;
+  char* cache_tmp_path = NULL;
+  int stdout_fd = -1;
+  if (g_cache_dir) {
+    cache_key = cache_path(ext, target_args, num_target_args);
+    if (cache_get(cache_key, NULL)) {
+      return 0;
+    }
+    cache_tmp_path = format("%s.%d.tmp", cache_key, (int)getpid());
+    fflush(stdout);
+    stdout_fd = dup(1);
+    if (stdout_fd < 0 || !freopen(cache_tmp_path, "w", stdout)) {
+      error("cannot open %s", cache_tmp_path);
+    }
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+  }
+
   Module* module = load_eir_from_file(filename);
 #endif
   target_func(module);
+
+#if !defined(NOFILE) && !defined(__eir__)
+  if (cache_key) {
+    if (fclose(stdout)) {
+      error("cannot write %s", cache_tmp_path);
+    }
+    FILE* out = fdopen(stdout_fd, "w");
+    if (!out || !copy_file(cache_tmp_path, out) || fclose(out)) {
+      error("cannot write the output");
+    }
+    if (rename(cache_tmp_path, cache_key)) {
+      error("cannot write %s", cache_key);
+    }
+    cache_evict();
+  }
+#endif
 }
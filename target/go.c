@@ -30,15 +30,18 @@ static void go_emit_inst(Inst* inst) {
     break;
 
   case PUTC:
-    emit_line("buf[0] = byte(%s); os.Stdout.Write(buf[:])", src_str(inst));
+    emit_line("out.WriteByte(byte(%s))", src_str(inst));
     break;
 
   case GETC:
-      emit_line("if n, err := os.Stdin.Read(buf[:]); n != 0 && err == nil { %s = " GO_INT_TYPE "(buf[0]) } else { %s = 0 }",
-                reg_names[inst->dst.reg], reg_names[inst->dst.reg]);
+    // Flush pending output only when the read may block.
+    emit_line("if in.Buffered() == 0 { out.Flush() }");
+    emit_line("if ch, err := in.ReadByte(); err == nil { %s = " GO_INT_TYPE "(ch) } else { %s = 0 }",
+              reg_names[inst->dst.reg], reg_names[inst->dst.reg]);
     break;
 
   case EXIT:
+    emit_line("out.Flush()");
     emit_line("os.Exit(0)");
     break;
 
@@ -81,7 +84,10 @@ static void go_init_state(Data* data) {
 
 void target_go(Module* module) {
   emit_line("package main");
-  emit_line("import \"os\"");
+  emit_line("import (");
+  emit_line(" \"bufio\"");
+  emit_line(" \"os\"");
+  emit_line(")");
 
   emit_line("func main() {");
   inc_indent();
@@ -90,8 +96,9 @@ void target_go(Module* module) {
     emit_line("var %s " GO_INT_TYPE, reg_names[i]);
     emit_line("_ = %s", reg_names[i]);
   }
-  emit_line("var buf [1]byte");
-  emit_line("_ = buf");
+  emit_line("out := bufio.NewWriterSize(os.Stdout, 65536)");
+  emit_line("in := bufio.NewReaderSize(os.Stdin, 65536)");
+  emit_line("_, _ = out, in");
 
   emit_line("mem := make([]" GO_INT_TYPE ", 1<<24)");
   go_init_state(module->data);
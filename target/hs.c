@@ -227,7 +227,7 @@ void target_hs(Module* module) {
 
   int num_inits = hs_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 128;
+  set_default_chunked_func_size(128);
   int num_funcs = emit_chunked_main_loop(module->text,
                                          hs_emit_func_prologue,
                                          hs_emit_func_epilogue,
@@ -257,3 +257,247 @@ void target_hs(Module* module) {
   emit_line("mainLoop");
 
 }
+
+// hs_strict: registers are strict Int arguments of local functions, one
+// per pc, which tail call each other, and memory is an unboxed
+// IOUArray Int Int32. Nothing is boxed or left as a thunk on the hot
+// path, so GHC compiles the blocks to jumps between machine registers.
+static int hs_strict_chunk_start;
+static int hs_strict_chunk_end;
+static int hs_strict_num_pcs;
+
+static const char* hs_strict_regs(void) {
+  return "a b c d bp sp";
+}
+
+static const char* hs_strict_goto(int pc) {
+  if (hs_strict_chunk_start <= pc && pc < hs_strict_chunk_end) {
+    return format("p%d %s", pc, hs_strict_regs());
+  }
+  return format("run mem %d %s", pc, hs_strict_regs());
+}
+
+static const char* hs_strict_cmp_str(Inst* inst) {
+  int op = normalize_cond(inst->op, 0);
+  const char* op_str;
+  switch (op) {
+    case JEQ:
+      op_str = "=="; break;
+    case JNE:
+      op_str = "/="; break;
+    case JLT:
+      op_str = "<"; break;
+    case JGT:
+      op_str = ">"; break;
+    case JLE:
+      op_str = "<="; break;
+    case JGE:
+      op_str = ">="; break;
+    case JMP:
+      return "True";
+    default:
+      error("oops");
+  }
+  return format("%s %s %s", reg_names[inst->dst.reg], op_str, src_str(inst));
+}
+
+static void hs_strict_emit_func_prologue(int func_id) {
+  hs_strict_chunk_start = func_id * CHUNKED_FUNC_SIZE;
+  hs_strict_chunk_end = hs_strict_chunk_start + CHUNKED_FUNC_SIZE;
+  if (hs_strict_chunk_end > hs_strict_num_pcs)
+    hs_strict_chunk_end = hs_strict_num_pcs;
+
+  emit_line("");
+  emit_line("chunk%d :: Mem -> Int -> Int -> Int -> Int -> Int -> Int -> Int"
+            " -> IO ()", func_id);
+  emit_line("chunk%d mem = go", func_id);
+  emit_line(" where");
+  inc_indent();
+  inc_indent();
+  emit_line("go !pc !a !b !c !d !bp !sp = case pc of");
+  for (int pc = hs_strict_chunk_start; pc < hs_strict_chunk_end; pc++) {
+    emit_line(" %d -> p%d %s", pc, pc, hs_strict_regs());
+  }
+  // Only the last chunk has pcs in its range which are past the end,
+  // and run would send them back here.
+  emit_line(" _ | pc >= %d -> exitSuccess", hs_strict_num_pcs);
+  emit_line("   | otherwise -> run mem pc %s", hs_strict_regs());
+}
+
+static bool hs_strict_jumped;
+static int hs_strict_pc;
+
+static void hs_strict_emit_fallthrough(void) {
+  if (hs_strict_pc >= 0 && !hs_strict_jumped) {
+    emit_line("%s", hs_strict_goto(hs_strict_pc + 1));
+  }
+  if (hs_strict_pc >= 0) {
+    dec_indent();
+  }
+}
+
+static void hs_strict_emit_func_epilogue(void) {
+  hs_strict_emit_fallthrough();
+  hs_strict_pc = -1;
+  dec_indent();
+  dec_indent();
+}
+
+static void hs_strict_emit_pc_change(int pc) {
+  hs_strict_emit_fallthrough();
+  emit_line("p%d !a !b !c !d !bp !sp = do", pc);
+  inc_indent();
+  hs_strict_pc = pc;
+  hs_strict_jumped = false;
+}
+
+static void hs_strict_emit_inst(Inst* inst) {
+  const char* dst = reg_names[inst->dst.reg];
+  switch (inst->op) {
+  case MOV:
+    emit_line("%s <- return $! %s", dst, src_str(inst));
+    break;
+
+  case ADD:
+    emit_line("%s <- return $! (%s + %s) .&. " UINT_MAX_STR,
+              dst, dst, src_str(inst));
+    break;
+
+  case SUB:
+    emit_line("%s <- return $! (%s - %s) .&. " UINT_MAX_STR,
+              dst, dst, src_str(inst));
+    break;
+
+  case LOAD:
+    emit_line("v <- unsafeRead mem %s", src_str(inst));
+    emit_line("%s <- return $! fromIntegral v", dst);
+    break;
+
+  case STORE:
+    emit_line("unsafeWrite mem %s (fromIntegral %s)", src_str(inst), dst);
+    break;
+
+  case PUTC:
+    emit_line("putChar (chr (%s .&. 255))", src_str(inst));
+    break;
+
+  case GETC:
+    emit_line("%s <- getByte", dst);
+    break;
+
+  case EXIT:
+    emit_line("exitSuccess");
+    break;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    emit_line("%s <- return $! fromEnum (%s)", dst, hs_strict_cmp_str(inst));
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+  case JMP: {
+    const char* target;
+    if (inst->jmp.type == REG) {
+      target = format("go %s %s", reg_names[inst->jmp.reg], hs_strict_regs());
+    } else {
+      target = hs_strict_goto(inst->jmp.imm);
+    }
+    if (inst->op == JMP) {
+      emit_line("%s", target);
+    } else {
+      emit_line("if %s then %s else %s", hs_strict_cmp_str(inst), target,
+                hs_strict_goto(inst->pc + 1));
+    }
+    hs_strict_jumped = true;
+    break;
+  }
+
+  default:
+    error("oops");
+  }
+}
+
+void target_hs_strict(Module* module) {
+  emit_line("{-# LANGUAGE BangPatterns #-}");
+  emit_line("import Data.Array.Base (unsafeRead, unsafeWrite)");
+  emit_line("import Data.Array.IO");
+  emit_line("import Data.Bits");
+  emit_line("import Data.Char");
+  emit_line("import Data.Int");
+  emit_line("import System.Exit");
+  emit_line("import System.IO");
+  emit_line("");
+  emit_line("type Mem = IOUArray Int Int32");
+  emit_line("");
+  emit_line("getByte :: IO Int");
+  emit_line("getByte = do");
+  emit_line(" eof <- isEOF");
+  emit_line(" if eof then return 0 else do");
+  emit_line("  ch <- getChar");
+  emit_line("  return $! ord ch");
+  emit_line("");
+  // The data image is base64 with four characters per word.
+  emit_line("initMem :: Mem -> String -> IO ()");
+  emit_line("initMem mem = go 0");
+  emit_line(" where");
+  emit_line("  go !i (w:x:y:z:rest) = do");
+  emit_line("   unsafeWrite mem i (fromIntegral (digit w `shiftL` 18 .|. "
+            "digit x `shiftL` 12 .|. digit y `shiftL` 6 .|. digit z))");
+  emit_line("   go (i + 1) rest");
+  emit_line("  go _ _ = return ()");
+  emit_line("  digit ch");
+  emit_line("   | ch >= 'a' = ord ch - 71");
+  emit_line("   | ch >= 'A' = ord ch - 65");
+  emit_line("   | ch >= '0' = ord ch + 4");
+  emit_line("   | ch == '+' = 62");
+  emit_line("   | otherwise = 63");
+  emit_line("");
+  emit_line("dataImage :: String");
+  emit_line("dataImage = concat [");
+  inc_indent();
+  emit_data_base64(module->data);
+  emit_line("\"\"]");
+  dec_indent();
+
+  hs_strict_num_pcs = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    hs_strict_num_pcs = inst->pc + 1;
+  }
+  hs_strict_pc = -1;
+  set_default_chunked_func_size(128);
+  int num_funcs = emit_chunked_main_loop(module->text,
+                                         hs_strict_emit_func_prologue,
+                                         hs_strict_emit_func_epilogue,
+                                         hs_strict_emit_pc_change,
+                                         hs_strict_emit_inst);
+
+  emit_line("");
+  emit_line("run :: Mem -> Int -> Int -> Int -> Int -> Int -> Int -> Int"
+            " -> IO ()");
+  emit_line("run mem !pc !a !b !c !d !bp !sp = case pc `quot` %d of",
+            CHUNKED_FUNC_SIZE);
+  for (int i = 0; i < num_funcs; i++) {
+    emit_line(" %d -> chunk%d mem pc %s", i, i, hs_strict_regs());
+  }
+  emit_line(" _ -> exitSuccess");
+  emit_line("");
+  emit_line("main :: IO ()");
+  emit_line("main = do");
+  emit_line(" hSetBinaryMode stdin True");
+  emit_line(" hSetBinaryMode stdout True");
+  emit_line(" mem <- newArray (0, " UINT_MAX_STR ") 0 :: IO Mem");
+  emit_line(" initMem mem dataImage");
+  emit_line(" run mem 0 0 0 0 0 0 0");
+}
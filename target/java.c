@@ -1,12 +1,24 @@
+#include <stdio.h>
+#include <string.h>
+
 #include <ir/ir.h>
 #include <target/util.h>
 
+static int java_mem_bits = 24;
+static int* java_chunk_starts;
+
+// Registers are locals of each chunk so the JIT can keep them in machine
+// registers, and they are spilled to the static fields when control
+// leaves the chunk.
 static void java_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("private static void func%d() {", func_id);
   inc_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("int %s = Main.%s;", reg_names[i], reg_names[i]);
+  }
   emit_line("while (%d <= pc && pc < %d) {",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
+            java_chunk_starts[func_id], java_chunk_starts[func_id + 1]);
   inc_indent();
   emit_line("switch (pc) {");
   emit_line("case -1:  /* dummy */");
@@ -19,6 +31,9 @@ static void java_emit_func_epilogue(void) {
   emit_line("pc++;");
   dec_indent();
   emit_line("}");
+  for (int i = 0; i < 7; i++) {
+    emit_line("Main.%s = %s;", reg_names[i], reg_names[i]);
+  }
   dec_indent();
   emit_line("}");
 }
@@ -50,11 +65,14 @@ static void java_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s];", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = mem[%s];", reg_names[inst->dst.reg],
+              mem_index_str(src_str(inst), java_mem_bits));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s;", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("mem[%s] = %s;",
+              mem_index_str(src_str(inst), java_mem_bits),
+              reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -101,30 +119,43 @@ static void java_emit_inst(Inst* inst) {
   }
 }
 
+static const int JAVA_INIT_WORDS = 4096;
+
+// Array initializers compile to code and hit the 64KB limit of a method,
+// so the data image is stored as string constants with two chars per
+// word. Each constant stays well below the 64KB limit of a class file
+// constant.
 static int java_init_state(Data* data) {
-  int prev_mc = -1;
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      int mc = mp / 1000;
-      while (prev_mc != mc) {
-        if (prev_mc != -1) {
-          dec_indent();
-          emit_line("}");
-        }
-        prev_mc++;
-        emit_line("static void init%d() {", prev_mc);
-        inc_indent();
+  int n = data_size(data);
+  char buf[256];
+  for (int mp = 0; mp < n; data = data->next, mp++) {
+    if (mp % JAVA_INIT_WORDS == 0) {
+      emit_line("static final String INIT%d =", mp / JAVA_INIT_WORDS);
+    }
+    if (mp % 16 == 0) {
+      strcpy(buf, " \"");
+    }
+    int v[2] = { data->v % 65536, data->v / 65536 };
+    for (int i = 0; i < 2; i++) {
+      if (v[i] < 256) {
+        sprintf(buf + strlen(buf), "\\%o", v[i]);
+      } else {
+        sprintf(buf + strlen(buf), "\\u%04x", v[i]);
       }
-      emit_line("mem[%d] = %d;", mp, data->v);
+    }
+    if (mp % 16 == 15 || mp == n - 1) {
+      emit_line("%s\" +", buf);
+    }
+    if (mp % JAVA_INIT_WORDS == JAVA_INIT_WORDS - 1 || mp == n - 1) {
+      emit_line(" \"\";");
     }
   }
 
-  if (prev_mc != -1) {
-    dec_indent();
-    emit_line("}");
-  }
-
-  return prev_mc + 1;
+  emit_line("static void init(String s, int mp) {");
+  emit_line(" for (int i = 0; i < s.length(); i += 2)");
+  emit_line("  mem[mp++] = s.charAt(i) | s.charAt(i + 1) << 16;");
+  emit_line("}");
+  return (n + JAVA_INIT_WORDS - 1) / JAVA_INIT_WORDS;
 }
 
 void target_java(Module* module) {
@@ -135,21 +166,25 @@ void target_java(Module* module) {
   }
   emit_line("static int[] mem;");
 
+  java_mem_bits = mem_size_bits(module->data);
   int num_inits = java_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 256;
-  int num_funcs = emit_chunked_main_loop(module->text,
-                                         java_emit_func_prologue,
-                                         java_emit_func_epilogue,
-                                         java_emit_pc_change,
-                                         java_emit_inst);
+  set_default_chunked_func_size(256);
+  int num_funcs;
+  java_chunk_starts = split_chunks(module->text, jvm_inst_size, JVM_PC_SIZE,
+                                   JVM_MAX_METHOD_SIZE, &num_funcs);
+  emit_split_main_loop(module->text, java_chunk_starts,
+                       java_emit_func_prologue,
+                       java_emit_func_epilogue,
+                       java_emit_pc_change,
+                       java_emit_inst);
 
   emit_line("public static void main(String[] args) {");
   inc_indent();
 
-  emit_line("mem = new int[1<<24];");
+  emit_line("mem = new int[1<<%d];", java_mem_bits);
   for (int i = 0; i < num_inits; i++) {
-    emit_line("init%d();", i);
+    emit_line("init(INIT%d, %d);", i, i * JAVA_INIT_WORDS);
   }
 
   emit_line("");
@@ -157,9 +192,17 @@ void target_java(Module* module) {
   inc_indent();
   emit_line("switch (pc / %d | 0) {", CHUNKED_FUNC_SIZE);
   for (int i = 0; i < num_funcs; i++) {
-    emit_line("case %d:", i);
-    emit_line(" func%d();", i);
-    emit_line(" break;");
+    int window = java_chunk_starts[i] / CHUNKED_FUNC_SIZE;
+    int end = java_chunk_starts[i + 1];
+    if (i == 0 || java_chunk_starts[i - 1] / CHUNKED_FUNC_SIZE != window) {
+      emit_line("case %d:", window);
+    }
+    if (i + 1 < num_funcs && end / CHUNKED_FUNC_SIZE == window) {
+      emit_line(" if (pc < %d) { func%d(); break; }", end, i);
+    } else {
+      emit_line(" func%d();", i);
+      emit_line(" break;");
+    }
   }
   emit_line("}");
   dec_indent();
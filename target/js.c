@@ -1,50 +1,52 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// VM registers live in these between chunk functions, which work on
+// locals named after reg_names.
+static const char* JS_GLOBAL_REGS[6] = {
+  "A", "B", "C", "D", "BP", "SP"
+};
+
 static void init_state_js(Data* data) {
   emit_line("var main = function(getchar, putchar) {");
 
-  for (int i = 0; i < 7; i++) {
-    emit_line("var %s = 0;", reg_names[i]);
+  for (int i = 0; i < 6; i++) {
+    emit_line("var %s = 0;", JS_GLOBAL_REGS[i]);
   }
+  emit_line("var pc = 0;");
   emit_line("var mem = new Int32Array(1 << 24);");
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line("mem[%d] = %d;", mp, data->v);
-    }
-  }
+  // The data image is one base64 string, with four characters per word.
+  emit_line("(function(s) {");
+  emit_line(" var b = new Int32Array(128);");
+  emit_line(" var t = "
+            "'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/';");
+  emit_line(" for (var i = 0; i < 64; i++) b[t.charCodeAt(i)] = i;");
+  emit_line(" for (var i = 0; i < s.length; i += 4) {");
+  emit_line("  mem[i >> 2] = (b[s.charCodeAt(i)] << 18 | b[s.charCodeAt(i + 1)] << 12 |");
+  emit_line("               b[s.charCodeAt(i + 2)] << 6 | b[s.charCodeAt(i + 3)]);");
+  emit_line(" }");
+  emit_line("})([");
+  emit_data_base64(data);
+  emit_line("].join(''));");
 }
 
 static void js_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("var func%d = function() {", func_id);
   inc_indent();
-  emit_line("while (%d <= pc && pc < %d && running) {",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
-  inc_indent();
-  emit_line("switch (pc) {");
-  emit_line("case -1:  // dummy");
-  inc_indent();
+  for (int i = 0; i < 6; i++) {
+    emit_line("let %s = %s;", reg_names[i], JS_GLOBAL_REGS[i]);
+  }
 }
 
 static void js_emit_func_epilogue(void) {
-  dec_indent();
-  emit_line("}");
-  emit_line("pc++;");
-  dec_indent();
-  emit_line("}");
+  for (int i = 0; i < 6; i++) {
+    emit_line("%s = %s;", JS_GLOBAL_REGS[i], reg_names[i]);
+  }
   dec_indent();
   emit_line("};");
 }
 
-static void js_emit_pc_change(int pc) {
-  emit_line("break;");
-  emit_line("");
-  dec_indent();
-  emit_line("case %d:", pc);
-  inc_indent();
-}
-
 static void js_emit_inst(Inst* inst) {
   switch (inst->op) {
   case MOV:
@@ -81,7 +83,7 @@ static void js_emit_inst(Inst* inst) {
     break;
 
   case EXIT:
-    emit_line("running = false; break;");
+    emit_line("running = false; break dispatch;");
     break;
 
   case DUMP:
@@ -104,8 +106,8 @@ static void js_emit_inst(Inst* inst) {
   case JLE:
   case JGE:
   case JMP:
-    emit_line("if (%s) pc = %s - 1;",
-              cmp_str(inst, "true"), value_str(&inst->jmp));
+    emit_line("if (%s) %s",
+              cmp_str(inst, "true"), structured_jump_str(inst));
     break;
 
   default:
@@ -118,11 +120,10 @@ void target_js(Module* module) {
 
   emit_line("var running = true;");
 
-  int num_funcs = emit_chunked_main_loop(module->text,
-                                         js_emit_func_prologue,
-                                         js_emit_func_epilogue,
-                                         js_emit_pc_change,
-                                         js_emit_inst);
+  int num_funcs = emit_structured_main_loop(module,
+                                            js_emit_func_prologue,
+                                            js_emit_func_epilogue,
+                                            js_emit_inst);
 
   emit_line("");
   emit_line("while (running) {");
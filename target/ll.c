@@ -393,3 +393,246 @@ void target_ll(Module* module) {
   dec_indent();
   emit_line("}");
 }
+
+static int ssa_idx;
+
+// Returns an i32 operand for |v|, loading registers from their allocas.
+static const char* ll_ssa_value(Value* v) {
+  if (v->type == REG) {
+    emit_line("%%t%d = load i32, i32* %%%s", ssa_idx, reg_names[v->reg]);
+    return format("%%t%d", ssa_idx++);
+  } else if (v->type == IMM) {
+    return format("%d", v->imm);
+  } else {
+    error("invalid value");
+  }
+}
+
+// Returns a pointer to the memory word at |v|.
+static const char* ll_ssa_mem_ptr(Value* v) {
+  const char* addr = ll_ssa_value(v);
+  emit_line("%%t%d = zext i32 %s to i64", ssa_idx, addr);
+  emit_line("%%t%d = getelementptr inbounds %%mem_t, %%mem_t* @mem, "
+            "i64 0, i64 %%t%d", ssa_idx + 1, ssa_idx);
+  ssa_idx += 2;
+  return format("%%t%d", ssa_idx - 1);
+}
+
+static const char* ll_ssa_cmp(Inst* inst) {
+  const char* lhs = ll_ssa_value(&inst->dst);
+  const char* rhs = ll_ssa_value(&inst->src);
+  emit_line("%%t%d = icmp %s i32 %s, %s",
+            ssa_idx, ll_cmp_str(inst), lhs, rhs);
+  return format("%%t%d", ssa_idx++);
+}
+
+// Starts a block for the instructions after a terminator. It is only
+// reachable as the fallthrough of a conditional branch, if at all.
+static void ll_ssa_emit_fallthrough(int idx) {
+  emit_line("");
+  emit_line("x%d:", idx);
+}
+
+static void ll_ssa_emit_inst(Inst* inst) {
+  const char* dst = reg_names[inst->dst.reg];
+  switch (inst->op) {
+  case MOV:
+    emit_line("store i32 %s, i32* %%%s", ll_ssa_value(&inst->src), dst);
+    break;
+
+  case ADD:
+  case SUB: {
+    const char* lhs = ll_ssa_value(&inst->dst);
+    const char* rhs = ll_ssa_value(&inst->src);
+    emit_line("%%t%d = %s i32 %s, %s",
+              ssa_idx, inst->op == ADD ? "add" : "sub", lhs, rhs);
+    emit_line("%%t%d = and i32 %%t%d, 16777215", ssa_idx + 1, ssa_idx);
+    emit_line("store i32 %%t%d, i32* %%%s", ssa_idx + 1, dst);
+    ssa_idx += 2;
+    break;
+  }
+
+  case LOAD: {
+    const char* ptr = ll_ssa_mem_ptr(&inst->src);
+    emit_line("%%t%d = load i32, i32* %s", ssa_idx, ptr);
+    emit_line("store i32 %%t%d, i32* %%%s", ssa_idx, dst);
+    ssa_idx++;
+    break;
+  }
+
+  case STORE: {
+    const char* ptr = ll_ssa_mem_ptr(&inst->src);
+    emit_line("store i32 %s, i32* %s", ll_ssa_value(&inst->dst), ptr);
+    break;
+  }
+
+  case PUTC:
+    emit_line("%%t%d = call i32 @putchar(i32 %s)",
+              ssa_idx, ll_ssa_value(&inst->src));
+    ssa_idx++;
+    break;
+
+  case GETC:
+    emit_line("%%t%d = call i32 @getchar()", ssa_idx);
+    emit_line("%%t%d = icmp eq i32 %%t%d, -1", ssa_idx + 1, ssa_idx);
+    emit_line("%%t%d = select i1 %%t%d, i32 0, i32 %%t%d",
+              ssa_idx + 2, ssa_idx + 1, ssa_idx);
+    emit_line("store i32 %%t%d, i32* %%%s", ssa_idx + 2, dst);
+    ssa_idx += 3;
+    break;
+
+  case EXIT:
+    emit_line("call void @exit(i32 0)");
+    emit_line("unreachable");
+    ll_ssa_emit_fallthrough(ssa_idx++);
+    break;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE: {
+    const char* cond = ll_ssa_cmp(inst);
+    emit_line("%%t%d = zext i1 %s to i32", ssa_idx, cond);
+    emit_line("store i32 %%t%d, i32* %%%s", ssa_idx, dst);
+    ssa_idx++;
+    break;
+  }
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+  case JMP: {
+    const char* cond = inst->op == JMP ? NULL : ll_ssa_cmp(inst);
+    int fallthrough = ssa_idx++;
+    if (inst->jmp.type == REG) {
+      // Register jumps share one indirectbr so the CFG stays linear in
+      // the number of pcs.
+      if (cond) {
+        emit_line("br i1 %s, label %%j%d, label %%x%d",
+                  cond, fallthrough, fallthrough);
+        emit_line("");
+        emit_line("j%d:", fallthrough);
+      }
+      emit_line("store i32 %s, i32* %%target", ll_ssa_value(&inst->jmp));
+      emit_line("br label %%dispatch");
+    } else if (cond) {
+      emit_line("br i1 %s, label %%L%d, label %%x%d",
+                cond, inst->jmp.imm, fallthrough);
+    } else {
+      emit_line("br label %%L%d", inst->jmp.imm);
+    }
+    ll_ssa_emit_fallthrough(fallthrough);
+    break;
+  }
+
+  default:
+    error("oops");
+  }
+}
+
+// The data image is the constant initializer of the first words of
+// memory, so main starts with no stores. @mem aliases it as a flat array.
+static void ll_ssa_emit_mem(Data* data) {
+  emit_line("%%mem_t = type [16777216 x i32]");
+  int n = data_size(data);
+  if (!n) {
+    emit_line("@mem = internal global %%mem_t zeroinitializer, align 16");
+    return;
+  }
+
+  const char* image_t = format("<{ [%d x i32], [%d x i32] }>",
+                               n, (1 << 24) - n);
+  emit_line("@mem_image = internal global %s <{ [%d x i32] [",
+            image_t, n);
+  char buf[256];
+  int len = 0;
+  for (int mp = 0; mp < n; data = data->next, mp++) {
+    len += sprintf(buf + len, "%si32 %d", mp % 8 ? ", " : " ", data->v);
+    if (mp % 8 == 7 || mp == n - 1) {
+      emit_line("%s%s", buf, mp == n - 1 ? "" : ",");
+      len = 0;
+    }
+  }
+  emit_line("], [%d x i32] zeroinitializer }>, align 16", (1 << 24) - n);
+  emit_line("@mem = internal alias %%mem_t, %%mem_t* bitcast (");
+  emit_line(" %s* @mem_image to %%mem_t*)", image_t);
+}
+
+// Emits the whole program as a single function. Registers are allocas
+// which mem2reg promotes to SSA values, direct jumps are plain branches
+// and register jumps go through indirectbr over blockaddress values, so
+// opt and llc can optimize across the whole program.
+void target_ll_ssa(Module* module) {
+  int num_pcs = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    num_pcs = inst->pc + 1;
+  }
+
+  ll_ssa_emit_mem(module->data);
+  emit_line("@labels = internal constant [%d x i8*] [", num_pcs + 1);
+  for (int pc = 0; pc <= num_pcs; pc++) {
+    emit_line(" i8* blockaddress(@main, %%L%d)%s",
+              pc, pc == num_pcs ? "" : ",");
+  }
+  emit_line("]");
+
+  emit_line("");
+  emit_line("declare i32 @getchar()");
+  emit_line("declare i32 @putchar(i32)");
+  emit_line("declare void @exit(i32)");
+
+  emit_line("");
+  emit_line("define i32 @main() {");
+  emit_line("entry:");
+  inc_indent();
+  for (int i = 0; i < 6; i++) {
+    emit_line("%%%s = alloca i32", reg_names[i]);
+    emit_line("store i32 0, i32* %%%s", reg_names[i]);
+  }
+  emit_line("%%target = alloca i32");
+
+  ssa_idx = 0;
+  int prev_pc = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      emit_line("br label %%L%d", inst->pc);
+      emit_line("");
+      emit_line("L%d:", inst->pc);
+    }
+    prev_pc = inst->pc;
+    ll_ssa_emit_inst(inst);
+  }
+
+  emit_line("br label %%L%d", num_pcs);
+  emit_line("");
+  emit_line("L%d:", num_pcs);
+  emit_line("ret i32 0");
+
+  emit_line("");
+  // Jumps past the end of the program go to its end.
+  emit_line("dispatch:");
+  emit_line("%%t%d = load i32, i32* %%target", ssa_idx);
+  emit_line("%%t%d = icmp ult i32 %%t%d, %d", ssa_idx + 1, ssa_idx, num_pcs);
+  emit_line("%%t%d = select i1 %%t%d, i32 %%t%d, i32 %d",
+            ssa_idx + 2, ssa_idx + 1, ssa_idx, num_pcs);
+  emit_line("%%t%d = zext i32 %%t%d to i64", ssa_idx + 3, ssa_idx + 2);
+  emit_line("%%t%d = getelementptr inbounds [%d x i8*], [%d x i8*]* @labels,",
+            ssa_idx + 4, num_pcs + 1, num_pcs + 1);
+  emit_line(" i64 0, i64 %%t%d", ssa_idx + 3);
+  emit_line("%%t%d = load i8*, i8** %%t%d", ssa_idx + 5, ssa_idx + 4);
+  emit_line("indirectbr i8* %%t%d, [", ssa_idx + 5);
+  for (int pc = 0; pc <= num_pcs; pc++) {
+    emit_line(" label %%L%d%s", pc, pc == num_pcs ? "" : ",");
+  }
+  emit_line("]");
+  dec_indent();
+  emit_line("}");
+}
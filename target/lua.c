@@ -25,12 +25,19 @@ const char* lua_cmp_str(Inst* inst, const char* true_str) {
   return format("%s %s %s", reg_names[inst->dst.reg], op_str, src_str(inst));
 }
 
+static int lua_mem_bits = 24;
+
 static void init_state_lua(Data* data) {
   for (int i = 0; i < 7; i++) {
     emit_line("%s = 0", reg_names[i]);
   }
-  emit_line("mem = {}");
-  emit_line("for _ = 0, ((1 << 24) -1) do mem[_] = 0; end");
+  if (use_sparse_mem()) {
+    emit_line("mem = setmetatable({}, {__index = function() return 0 end})");
+  } else {
+    lua_mem_bits = mem_size_bits(data);
+    emit_line("mem = {}");
+    emit_line("for _ = 0, ((1 << %d) -1) do mem[_] = 0; end", lua_mem_bits);
+  }
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
       emit_line("mem[%d] = %d", mp, data->v);
@@ -87,11 +94,13 @@ static void lua_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s]", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = mem[%s]", reg_names[inst->dst.reg],
+              mem_index_str(src_str(inst), lua_mem_bits));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("mem[%s] = %s", mem_index_str(src_str(inst), lua_mem_bits),
+              reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -1,49 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <ir/ir.h>
 #include <target/util.h>
 
+static int py_mem_bits = 24;
+
 static void init_state_py(Data* data) {
+  emit_line("import collections");
   emit_line("import sys");
-  for (int i = 0; i < 7; i++) {
+  emit_line("");
+  emit_line("def main():");
+  inc_indent();
+  for (int i = 0; i < 6; i++) {
     emit_line("%s = 0", reg_names[i]);
   }
-  emit_line("mem = [0] * (1 << 24)");
+  if (use_sparse_mem()) {
+    emit_line("mem = collections.defaultdict(int)");
+  } else {
+    py_mem_bits = mem_size_bits(data);
+    emit_line("mem = [0] * (1 << %d)", py_mem_bits);
+  }
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
       emit_line("mem[%d] = %d", mp, data->v);
     }
   }
+  emit_line("stdin = sys.stdin.buffer");
+  emit_line("putc = sys.stdout.write");
 }
 
-static void py_emit_func_prologue(int func_id) {
-  emit_line("");
-  emit_line("def func%d():", func_id);
-  inc_indent();
-  for (int i = 0; i < 7; i++) {
-    emit_line("global %s", reg_names[i]);
+// Every basic block is a closure in main which returns the next pc, so
+// registers are cells of main instead of globals. A closure declares the
+// registers it assigns to as nonlocal. Blocks start at jump targets and
+// where register jumps may land, and are defined by one function per
+// chunk, as CPython compiles many closures in one scope slowly.
+static void py_emit_block_prologue(Inst* inst, bool* is_leader) {
+  int pc = inst->pc;
+  bool assigned[6] = {0};
+  for (; inst && (inst->pc == pc || !is_leader[inst->pc]);
+       inst = inst->next) {
+    switch (inst->op) {
+    case MOV:
+    case ADD:
+    case SUB:
+    case LOAD:
+    case GETC:
+    case EQ:
+    case NE:
+    case LT:
+    case GT:
+    case LE:
+    case GE:
+      assigned[inst->dst.reg] = true;
+      break;
+    default:
+      break;
+    }
   }
-  emit_line("global mem");
-  emit_line("");
 
-  emit_line("while %d <= pc and pc < %d:",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
-  inc_indent();
-  emit_line("if False:");
+  emit_line("");
+  emit_line("def pc%d():", pc);
   inc_indent();
-  emit_line("pass");
-}
-
-static void py_emit_func_epilogue(void) {
-  dec_indent();
-  emit_line("pc += 1");
-  dec_indent();
-  dec_indent();
+  char buf[64];
+  int len = 0;
+  for (int i = 0; i < 6; i++) {
+    if (assigned[i]) {
+      len += sprintf(buf + len, "%s%s", len ? ", " : "", reg_names[i]);
+    }
+  }
+  if (len) {
+    emit_line("nonlocal %s", buf);
+  }
 }
 
-static void py_emit_pc_change(int pc) {
-  emit_line("");
+static void py_emit_block_epilogue(int pc, int next_pc) {
+  emit_line("return %d", next_pc);
   dec_indent();
-  emit_line("elif pc == %d:", pc);
-  inc_indent();
+  emit_line("blocks[%d] = pc%d", pc, pc);
 }
 
 static void py_emit_inst(Inst* inst) {
@@ -65,19 +100,21 @@ static void py_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = mem[%s]", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = mem[%s]", reg_names[inst->dst.reg],
+              mem_index_str(src_str(inst), py_mem_bits));
     break;
 
   case STORE:
-    emit_line("mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("mem[%s] = %s", mem_index_str(src_str(inst), py_mem_bits),
+              reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
-    emit_line("sys.stdout.write(chr(%s))", src_str(inst));
+    emit_line("putc(chr(%s))", src_str(inst));
     break;
 
   case GETC:
-    emit_line("_ = sys.stdin.read(1); %s = ord(_) if _ else 0",
+    emit_line("_ = stdin.read(1); %s = _[0] if _ else 0",
               reg_names[inst->dst.reg]);
     break;
 
@@ -105,7 +142,11 @@ static void py_emit_inst(Inst* inst) {
   case JLE:
   case JGE:
   case JMP:
-    emit_line("if %s: pc = %s - 1",
+    if (inst->op == JMP) {
+      emit_line("return %s", value_str(&inst->jmp));
+      break;
+    }
+    emit_line("if %s: return %s",
               cmp_str(inst, "True"), value_str(&inst->jmp));
     break;
 
@@ -117,18 +158,97 @@ static void py_emit_inst(Inst* inst) {
 void target_py(Module* module) {
   init_state_py(module->data);
 
-  int num_funcs = emit_chunked_main_loop(module->text,
-                                         py_emit_func_prologue,
-                                         py_emit_func_epilogue,
-                                         py_emit_pc_change,
-                                         py_emit_inst);
+  int num_pcs = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    num_pcs = inst->pc + 1;
+  }
+  bool* is_leader = find_indirect_targets(module, num_pcs);
+  is_leader[0] = true;
+  bool has_reg_jump = false;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == IMM &&
+        inst->jmp.imm < num_pcs) {
+      is_leader[inst->jmp.imm] = true;
+    }
+    if (inst->op >= JEQ && inst->op <= JMP && inst->jmp.type == REG) {
+      has_reg_jump = true;
+    }
+  }
+
+  emit_line("blocks = [None] * %d", num_pcs);
+  int prev_pc = -1;
+  int block_pc = -1;
+  int func_id = -1;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (prev_pc != inst->pc && is_leader[inst->pc]) {
+      if (block_pc >= 0) {
+        py_emit_block_epilogue(block_pc, inst->pc);
+      }
+      if (func_id != inst->pc / CHUNKED_FUNC_SIZE) {
+        if (func_id >= 0) {
+          dec_indent();
+          emit_line("func%d()", func_id);
+        }
+        func_id = inst->pc / CHUNKED_FUNC_SIZE;
+        emit_line("");
+        emit_line("def func%d():", func_id);
+        inc_indent();
+      }
+      py_emit_block_prologue(inst, is_leader);
+      block_pc = inst->pc;
+    }
+    prev_pc = inst->pc;
+    py_emit_inst(inst);
+  }
+  if (block_pc >= 0) {
+    py_emit_block_epilogue(block_pc, num_pcs);
+    dec_indent();
+    emit_line("func%d()", func_id);
+  }
+
+  // A register jump may land on a pc which is not a leader, as code
+  // addresses can be computed, so such pcs get a block of their own.
+  if (has_reg_jump) {
+    bool* every_pc = malloc(num_pcs + 1);
+    memset(every_pc, 1, num_pcs + 1);
+    prev_pc = -1;
+    func_id = -1;
+    for (Inst* inst = module->text; inst; inst = inst->next) {
+      if (is_leader[inst->pc]) {
+        continue;
+      }
+      if (prev_pc != inst->pc) {
+        if (prev_pc >= 0) {
+          py_emit_block_epilogue(prev_pc, prev_pc + 1);
+        }
+        if (func_id != inst->pc / CHUNKED_FUNC_SIZE) {
+          if (func_id >= 0) {
+            dec_indent();
+            emit_line("pcs%d()", func_id);
+          }
+          func_id = inst->pc / CHUNKED_FUNC_SIZE;
+          emit_line("");
+          emit_line("def pcs%d():", func_id);
+          inc_indent();
+        }
+        py_emit_block_prologue(inst, every_pc);
+      }
+      prev_pc = inst->pc;
+      py_emit_inst(inst);
+    }
+    if (prev_pc >= 0) {
+      py_emit_block_epilogue(prev_pc, prev_pc + 1);
+      dec_indent();
+      emit_line("pcs%d()", func_id);
+    }
+    free(every_pc);
+  }
 
   emit_line("");
+  emit_line("pc = 0");
   emit_line("while True:");
-  inc_indent();
-  emit_line("if False: pass");
-  for (int i = 0; i < num_funcs; i++) {
-    emit_line("elif pc < %d: func%d()", (i + 1) * CHUNKED_FUNC_SIZE, i);
-  }
+  emit_line(" pc = blocks[pc]()");
   dec_indent();
+  emit_line("");
+  emit_line("main()");
 }
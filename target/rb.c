@@ -5,12 +5,19 @@ static const char* RB_REG_NAMES[] = {
   "@a", "@b", "@c", "@d", "@bp", "@sp", "@pc"
 };
 
+static int rb_mem_bits = 24;
+
 static void init_state_rb(Data* data) {
   reg_names = RB_REG_NAMES;
   for (int i = 0; i < 7; i++) {
     emit_line("%s = 0", reg_names[i]);
   }
-  emit_line("@mem = [0] * (1 << 24)");
+  if (use_sparse_mem()) {
+    emit_line("@mem = Hash.new(0)");
+  } else {
+    rb_mem_bits = mem_size_bits(data);
+    emit_line("@mem = [0] * (1 << %d)", rb_mem_bits);
+  }
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
       emit_line("@mem[%d] = %d", mp, data->v);
@@ -65,11 +72,13 @@ static void rb_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("%s = @mem[%s]", reg_names[inst->dst.reg], src_str(inst));
+    emit_line("%s = @mem[%s]", reg_names[inst->dst.reg],
+              mem_index_str(src_str(inst), rb_mem_bits));
     break;
 
   case STORE:
-    emit_line("@mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("@mem[%s] = %s", mem_index_str(src_str(inst), rb_mem_bits),
+              reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -2,7 +2,7 @@
 #include <target/util.h>
 
 static void rs_init_state(void) {
-  emit_line("use std::io::Read;");
+  emit_line("use std::io::{BufRead, BufReader, BufWriter, StdinLock, StdoutLock, Write};");
   emit_line("use std::process;");
 
   emit_line("");
@@ -13,28 +13,43 @@ static void rs_init_state(void) {
     emit_line("%s: i32,", reg_names[i]);
   }
   emit_line("mem: Vec<i32>,");
+  emit_line("input: BufReader<StdinLock<'static>>,");
+  emit_line("output: BufWriter<StdoutLock<'static>>,");
   dec_indent();
   emit_line("}");
 
+  // Pending output is flushed only when the read may block.
   emit_line("");
   emit_line("#[allow(dead_code)]");
-  emit_line("fn getchar() -> u8 {");
+  emit_line("fn getchar(state: &mut State) -> u8 {");
   inc_indent();
-  emit_line("let ch = match std::io::stdin().bytes().next().and_then(|result| result.ok()).map(|byte| byte as u8) {");
+  emit_line("if state.input.buffer().is_empty() {");
+  emit_line(" state.output.flush().unwrap();");
+  emit_line("}");
+  emit_line("let ch = match state.input.fill_buf() {");
   inc_indent();
-  emit_line("None => 0,");
-  emit_line("Some(ch) => ch,");
+  emit_line("Ok(buf) if !buf.is_empty() => buf[0],");
+  emit_line("_ => return 0,");
   dec_indent();
   emit_line("};");
+  emit_line("state.input.consume(1);");
   emit_line("ch");
   dec_indent();
   emit_line("}");
 
   emit_line("");
   emit_line("#[allow(dead_code)]");
-  emit_line("fn putchar(ch: u8) {");
+  emit_line("fn putchar(output: &mut BufWriter<StdoutLock<'static>>, ch: u8) {");
+  inc_indent();
+  emit_line("output.write_all(&[ch]).unwrap();");
+  dec_indent();
+  emit_line("}");
+
+  emit_line("");
+  emit_line("fn exit(state: &mut State, code: i32) -> ! {");
   inc_indent();
-  emit_line("print!(\"{}\", ch as char);");
+  emit_line("state.output.flush().unwrap();");
+  emit_line("process::exit(code);");
   dec_indent();
   emit_line("}");
 }
@@ -58,7 +73,7 @@ static void rs_emit_func_epilogue(void) {
   emit_line("},");
   emit_line("_ => {");
   inc_indent();
-  emit_line("process::exit(1);");
+  emit_line("exit(&mut state, 1);");
   dec_indent();
   emit_line("},");
   dec_indent();
@@ -151,15 +166,15 @@ static void rs_emit_inst(Inst* inst) {
     break;
 
   case PUTC:
-    emit_line("putchar(%s as u8);", rs_src_str(inst));
+    emit_line("putchar(&mut state.output, %s as u8);", rs_src_str(inst));
     break;
 
   case GETC:
-    emit_line("%s = getchar() as i32;", rs_reg(inst->dst.reg));
+    emit_line("%s = getchar(&mut state) as i32;", rs_reg(inst->dst.reg));
     break;
 
   case EXIT:
-    emit_line("process::exit(0);");
+    emit_line("exit(&mut state, 0);");
     break;
 
   case DUMP:
@@ -214,6 +229,8 @@ void target_rs(Module* module) {
     emit_line("%s: 0,", reg_names[i]);
   }
   emit_line("mem: vec![0; 1<<24],");
+  emit_line("input: BufReader::with_capacity(65536, std::io::stdin().lock()),");
+  emit_line("output: BufWriter::with_capacity(65536, std::io::stdout().lock()),");
   dec_indent();
   emit_line("};");
 
@@ -231,7 +248,7 @@ void target_rs(Module* module) {
   for (int i = 0; i < num_funcs; i++) {
     emit_line("%d => state = func%d(state),", i, i);
   }
-  emit_line("_ => process::exit(1),");
+  emit_line("_ => exit(&mut state, 1),");
   emit_line("}");
   dec_indent();
   emit_line("}");
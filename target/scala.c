@@ -1,12 +1,19 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+static int* scala_chunk_starts;
+
+// Registers are local variables of each chunk, which are spilled to the
+// fields of Main when control leaves the chunk.
 static void scala_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("private def func%d(): Unit = {", func_id);
   inc_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("var %s: Int = Main.%s", reg_names[i], reg_names[i]);
+  }
   emit_line("while (%d <= pc && pc < %d) {",
-            func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
+            scala_chunk_starts[func_id], scala_chunk_starts[func_id + 1]);
   inc_indent();
   emit_line("pc match {");
   inc_indent();
@@ -21,6 +28,9 @@ static void scala_emit_func_epilogue(void) {
   emit_line("pc += 1");
   dec_indent();
   emit_line("}");
+  for (int i = 0; i < 7; i++) {
+    emit_line("Main.%s = %s", reg_names[i], reg_names[i]);
+  }
   dec_indent();
   emit_line("}");
 }
@@ -138,12 +148,16 @@ void target_scala(Module* module) {
 
   int num_inits = scala_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 128;
-  int num_funcs = emit_chunked_main_loop(module->text,
-                                         scala_emit_func_prologue,
-                                         scala_emit_func_epilogue,
-                                         scala_emit_pc_change,
-                                         scala_emit_inst);
+  set_default_chunked_func_size(128);
+  int num_funcs;
+  scala_chunk_starts = split_chunks(module->text, jvm_inst_size,
+                                    JVM_PC_SIZE, JVM_MAX_METHOD_SIZE,
+                                    &num_funcs);
+  emit_split_main_loop(module->text, scala_chunk_starts,
+                       scala_emit_func_prologue,
+                       scala_emit_func_epilogue,
+                       scala_emit_pc_change,
+                       scala_emit_inst);
 
   emit_line("def main(args: Array[String]): Unit = {");
   inc_indent();
@@ -158,7 +172,16 @@ void target_scala(Module* module) {
   emit_line("(pc / %d | 0) match {", CHUNKED_FUNC_SIZE);
   inc_indent();
   for (int i = 0; i < num_funcs; i++) {
-    emit_line("case %d => func%d()", i, i);
+    int window = scala_chunk_starts[i] / CHUNKED_FUNC_SIZE;
+    int end = scala_chunk_starts[i + 1];
+    if (i == 0 || scala_chunk_starts[i - 1] / CHUNKED_FUNC_SIZE != window) {
+      emit_line("case %d =>", window);
+    }
+    if (i + 1 < num_funcs && end / CHUNKED_FUNC_SIZE == window) {
+      emit_line(" if (pc < %d) func%d() else", end, i);
+    } else {
+      emit_line(" func%d()", i);
+    }
   }
   dec_indent();
   emit_line("}");
@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <string.h>
+
 #include <ir/ir.h>
 #include <target/util.h>
 
@@ -13,6 +15,7 @@ typedef enum {
   SQLITE3_STEP,
   SQLITE3_RUN,
   SQLITE3_MEM,
+  SQLITE3_STACK,
   SQLITE3_IN,
   SQLITE3_OUT,
   SQLITE3_NUM_COLS
@@ -20,7 +23,7 @@ typedef enum {
 
 static const char* COL_NAMES[SQLITE3_NUM_COLS] = {
   "a", "b", "c", "d", "bp", "sp", "pc", "step",
-  "running", "mem", "stdin", "stdout"
+  "running", "mem", "stack", "stdin", "stdout"
 };
 
 typedef struct SQLite3CaseExpr_ {
@@ -57,132 +60,219 @@ const char* sqlite3_cmp_str(Inst* inst) {
     default:
       error("oops");
   }
-  return format("%s %s %s", COL_NAMES[inst->dst.reg], op_str, src_str(inst));
+  return format("%s %s %s", reg_names[inst->dst.reg], op_str, src_str(inst));
+}
+
+// Memory is kept in two blobs of 8 decimal digits per word, "mem" for the
+// addresses below SQLITE3_STACK_START and "stack" for the others, counted
+// down from the top so the stack growing down from address 0 stays small.
+// Words past the end of a blob are zero. A load is a substr, and a store
+// copies the blob once, where json_set re-serialized the whole memory and
+// json_extract parsed it again.
+#define SQLITE3_STACK_START "8388608"
+
+static const char* sqlite3_offset_str(const char* addr, bool stack) {
+  if (stack) {
+    return format("(" UINT_MAX_STR " - %s) * 8", addr);
+  }
+  return format("%s * 8", addr);
+}
+
+static const char* sqlite3_load_str(const char* addr) {
+  return format("CASE WHEN %s < " SQLITE3_STACK_START
+                " THEN CAST(substr(mem, %s + 1, 8) AS INTEGER)"
+                " ELSE CAST(substr(stack, %s + 1, 8) AS INTEGER) END",
+                addr, sqlite3_offset_str(addr, false),
+                sqlite3_offset_str(addr, true));
+}
+
+static const char* sqlite3_store_str(const char* addr, const char* v,
+                                     bool stack) {
+  const char* col = COL_NAMES[stack ? SQLITE3_STACK : SQLITE3_MEM];
+  const char* off = sqlite3_offset_str(addr, stack);
+  return format("CASE WHEN %s %s " SQLITE3_STACK_START " THEN"
+                " CAST(CASE WHEN length(%s) < %s"
+                " THEN printf('%%-*s', %s, %s) ELSE substr(%s, 1, %s) END"
+                " || printf('%%08d', %s) || substr(%s, %s + 9) AS BLOB)"
+                " ELSE %s END",
+                addr, stack ? ">=" : "<",
+                col, off, off, col, col, off,
+                v, col, off, col);
+}
+
+// Sets the expressions which |inst| assigns to columns in |exprs|.
+static void sqlite3_inst_exprs(Inst* inst, const char* exprs[]) {
+  switch (inst->op) {
+  case MOV:
+    exprs[inst->dst.reg] = src_str(inst);
+    break;
+
+  case ADD:
+    exprs[inst->dst.reg] = format("(%s + %s) & " UINT_MAX_STR,
+                                  reg_names[inst->dst.reg], src_str(inst));
+    break;
+
+  case SUB:
+    exprs[inst->dst.reg] = format("(%s - %s) & " UINT_MAX_STR,
+                                  reg_names[inst->dst.reg], src_str(inst));
+    break;
+
+  case LOAD:
+    exprs[inst->dst.reg] = sqlite3_load_str(src_str(inst));
+    break;
+
+  case STORE:
+    exprs[SQLITE3_MEM] = sqlite3_store_str(src_str(inst),
+                                           reg_names[inst->dst.reg], false);
+    exprs[SQLITE3_STACK] = sqlite3_store_str(src_str(inst),
+                                             reg_names[inst->dst.reg], true);
+    break;
+
+  case PUTC:
+    exprs[SQLITE3_OUT] = format("%s||char(%s)",
+                                reg_names[SQLITE3_OUT], src_str(inst));
+    break;
+
+  case GETC:
+    exprs[SQLITE3_IN] = "substr(stdin, 2)";
+    // todo: can't read a single byte from multibyte character
+    exprs[inst->dst.reg] =
+        "CASE WHEN length(stdin) = 0 THEN 0 ELSE unicode(stdin) END";
+    break;
+
+  case EXIT:
+    exprs[SQLITE3_RUN] = "0";
+    break;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    exprs[inst->dst.reg] = sqlite3_cmp_str(inst);
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    exprs[SQLITE3_PC] = format("CASE WHEN %s THEN %s ELSE pc+1 END",
+                               sqlite3_cmp_str(inst),
+                               value_str(&inst->jmp));
+    exprs[SQLITE3_STEP] = "0";
+    break;
+
+  case JMP:
+    exprs[SQLITE3_PC] = value_str(&inst->jmp);
+    exprs[SQLITE3_STEP] = "0";
+    break;
+
+  default:
+    error("oops");
+  }
+}
+
+// Each step is one row of the recursive CTE. Instructions of a pc are
+// fused into a step by replacing the columns they read with the
+// expressions assigned earlier in the step, so a whole basic block which
+// does not write memory runs as one row. A step ends after STORE, which
+// would otherwise copy the memory once per use of the new blob, and after
+// GETC for the same reason, after EXIT so the rest of the pc does not run,
+// and before an expression would grow past SQLITE3_MAX_EXPR_LEN.
+static const int SQLITE3_MAX_EXPR_LEN = 2000;
+
+static const char* sqlite3_pending[SQLITE3_NUM_COLS];
+static const char* sqlite3_names[SQLITE3_NUM_COLS];
+
+static void sqlite3_flush_step(SQLite3CaseExpr* cols[], int pc, int step) {
+  for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+    if (sqlite3_pending[i]) {
+      cols[i] = sqlite3_add_expr(cols[i], pc, step, sqlite3_pending[i]);
+    }
+    sqlite3_pending[i] = NULL;
+    sqlite3_names[i] = COL_NAMES[i];
+  }
 }
 
 static void sqlite3_transpose_insts(Inst* inst, SQLite3CaseExpr* cols[]) {
-  
+  reg_names = sqlite3_names;
+  for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+    sqlite3_names[i] = COL_NAMES[i];
+  }
+
   int step = 0;
   int prev_pc = -1;
-  SQLite3Col col_idx = 0;
-  const char* expr = NULL;
-  int updcols = 0;
+  bool step_used = false;
+  bool must_break = false;
 
   for (; inst; inst = inst->next) {
-    if (prev_pc != inst-> pc) {
+    if (prev_pc != inst->pc) {
       if (prev_pc != -1) {
-        step++;
-        cols[SQLITE3_PC] = sqlite3_add_expr(cols[SQLITE3_PC], prev_pc, step, "pc+1");
-        cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], prev_pc, step, "0");
+        if (!sqlite3_pending[SQLITE3_PC]) {
+          sqlite3_pending[SQLITE3_PC] = "pc+1";
+          sqlite3_pending[SQLITE3_STEP] = "0";
+        }
+        sqlite3_flush_step(cols, prev_pc, step);
       }
-      updcols = 0;
       step = 0;
+      step_used = false;
+      must_break = false;
     }
-
-    int usecol = ((inst->src.type == REG) ? (1 << inst->src.reg) : 0) |
-                 ((inst->dst.type == REG) ? (1 << inst->dst.reg) : 0);
-
-    if ((usecol & updcols) != 0) {
-      step++;
-      updcols = 0;
+    prev_pc = inst->pc;
+    if (inst->op == DUMP) {
+      continue;
     }
 
-    switch (inst->op) {
-    case MOV:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = src_str(inst);
-      break;
-
-    case ADD:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = format("(%s + %s) & " UINT_MAX_STR,
-                    COL_NAMES[inst->dst.reg], src_str(inst));
-      break;
-
-    case SUB:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = format("(%s - %s) & " UINT_MAX_STR,
-                COL_NAMES[inst->dst.reg], src_str(inst));
-      break;
-
-    case LOAD:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = format("coalesce(json_extract(mem, '$.'||%s),0)", src_str(inst));
-      break;
-
-    case STORE:
-      col_idx = SQLITE3_MEM;
-      expr = format("json_set(mem, '$.'||%s, %s)",
-                    src_str(inst), COL_NAMES[inst->dst.reg]);
-      break;
-
-    case PUTC:
-      col_idx = SQLITE3_OUT;
-      expr = format("stdout||char(%s)", src_str(inst));
-      break;
-
-    case GETC:
-      cols[SQLITE3_IN] = sqlite3_add_expr(cols[SQLITE3_IN], inst->pc, step,
-                                          "substr(stdin, 2)");
-      col_idx = (SQLite3Col)inst->dst.reg;
-      // todo: can't read a single byte from multibyte character
-      expr = "CASE WHEN length(stdin) = 0 THEN 0 ELSE unicode(stdin) END";
-      break;
-
-    case EXIT:
-      col_idx = SQLITE3_RUN;
-      expr = "0";
-      break;
-
-    case DUMP:
-      goto next_inst;
-
-    case EQ:
-    case NE:
-    case LT:
-    case GT:
-    case LE:
-    case GE:
-      col_idx = (SQLite3Col)inst->dst.reg;
-      expr = sqlite3_cmp_str(inst);
-      break;
-
-    case JEQ:
-    case JNE:
-    case JLT:
-    case JGT:
-    case JLE:
-    case JGE:
-      expr = format("CASE WHEN %s THEN 0 ELSE step+1 END", sqlite3_cmp_str(inst));
-      cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], inst->pc, step, expr);
-      col_idx = SQLITE3_PC;
-      expr = format("CASE WHEN %s THEN %s ELSE pc END",
-                    sqlite3_cmp_str(inst), value_str(&inst->jmp));
-      break;
-    case JMP:
-      cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], inst->pc, step, "0");
-      col_idx = SQLITE3_PC;
-      expr = value_str(&inst->jmp);
-      break;
-
-    default:
-      error("oops");
+    const char* exprs[SQLITE3_NUM_COLS] = {};
+    sqlite3_inst_exprs(inst, exprs);
+    bool too_long = false;
+    for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+      if (exprs[i] && strlen(exprs[i]) > SQLITE3_MAX_EXPR_LEN) {
+        too_long = true;
+      }
     }
-
-    cols[col_idx] = sqlite3_add_expr(cols[col_idx], inst->pc, step, expr);
-
-    if (inst->op == GETC || inst->op == PUTC || inst->op == STORE) {
+    if (step_used && (must_break || too_long)) {
+      sqlite3_flush_step(cols, inst->pc, step);
       step++;
-      updcols = 0;
-    } else {
-      updcols |= (1 << col_idx);
+      for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+        exprs[i] = NULL;
+      }
+      sqlite3_inst_exprs(inst, exprs);
     }
 
-  next_inst:
-    prev_pc = inst->pc;
+    for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+      if (exprs[i]) {
+        sqlite3_pending[i] = exprs[i];
+      }
+    }
+    for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
+      if (!exprs[i]) {
+        continue;
+      }
+      const char* p = exprs[i];
+      while ((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')) {
+        p++;
+      }
+      if (!*p) {
+        sqlite3_names[i] = exprs[i];
+      } else {
+        sqlite3_names[i] = format("(%s)", exprs[i]);
+      }
+    }
+    step_used = true;
+    must_break = inst->op == STORE || inst->op == GETC || inst->op == EXIT;
+  }
+  if (!sqlite3_pending[SQLITE3_PC]) {
+    sqlite3_pending[SQLITE3_PC] = "pc+1";
+    sqlite3_pending[SQLITE3_STEP] = "0";
   }
-  cols[SQLITE3_PC] = sqlite3_add_expr(cols[SQLITE3_PC], prev_pc, step, "pc+1");
-  cols[SQLITE3_STEP] = sqlite3_add_expr(cols[SQLITE3_STEP], prev_pc, step, "0");
+  sqlite3_flush_step(cols, prev_pc, step);
 }
 
 
@@ -254,7 +344,9 @@ static void sqlite3_emit_column(SQLite3CaseExpr* ce, SQLite3Col col) {
 
 
 void target_sqlite3(Module* module) {
-  reg_names = COL_NAMES;
+  // SQLite evaluates the CASE arms of a part one by one, so small parts
+  // are much faster (see tools/chunked_func_size.txt).
+  set_default_chunked_func_size(128);
   SQLite3CaseExpr roots[SQLITE3_NUM_COLS] = {};
   SQLite3CaseExpr* cols[SQLITE3_NUM_COLS];
   for (int i = 0; i < SQLITE3_NUM_COLS; i++) {
@@ -279,14 +371,19 @@ void target_sqlite3(Module* module) {
   }
   emit_line("0 step,");
   emit_line("1 running,");
-  emit_line("json('{");
-  int mp = 0;
-  for (Data* data = module->data; data; data = data->next, mp++) {
-    if (data->v) {
-      emit_line(" %c\"%d\":%d", mp ? ',' : ' ', mp, data->v);
+  emit_line("CAST(");
+  int n = data_size(module->data);
+  char buf[16 * 8 + 1];
+  Data* data = module->data;
+  for (int mp = 0; mp < n; data = data->next, mp++) {
+    sprintf(buf + mp % 16 * 8, "%08d", data->v);
+    if (mp % 16 == 15 || mp == n - 1) {
+      emit_line(" '%s' ||", buf);
     }
   }
-  emit_line("}') mem,");
+  // substr() of an empty blob is NULL, so neither blob starts empty.
+  emit_line(" '%s' AS BLOB) mem,", n ? "" : "00000000");
+  emit_line("CAST('00000000' AS BLOB) stack,");
   emit_line("(SELECT i FROM stdin) stdin,");
   emit_line("'' stdout,");
   emit_line("0 cycle");
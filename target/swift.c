@@ -2,6 +2,45 @@
 #include <ir/ir.h>
 #include <target/util.h>
 
+// Output is kept in a buffer which is written when it fills up, at EXIT,
+// and before a read of stdin which may block.
+static void swift_emit_io(void) {
+  emit_line("private var outBuf = [UInt8](repeating: 0, count: 65536)");
+  emit_line("private var outLen = 0");
+  emit_line("private var inBuf = [UInt8](repeating: 0, count: 65536)");
+  emit_line("private var inPos = 0");
+  emit_line("private var inLen = 0");
+  emit_line("");
+  emit_line("private func flushOutput() {");
+  emit_line(" if outLen > 0 {");
+  emit_line("  _ = write(1, &outBuf, outLen)");
+  emit_line("  outLen = 0");
+  emit_line(" }");
+  emit_line("}");
+  emit_line("");
+  emit_line("private func putByte(_ c: Int) {");
+  emit_line(" outBuf[outLen] = UInt8(truncatingIfNeeded: c)");
+  emit_line(" outLen += 1");
+  emit_line(" if outLen == outBuf.count {");
+  emit_line("  flushOutput()");
+  emit_line(" }");
+  emit_line("}");
+  emit_line("");
+  emit_line("private func getByte() -> Int {");
+  emit_line(" if inPos == inLen {");
+  emit_line("  flushOutput()");
+  emit_line("  inPos = 0");
+  emit_line("  inLen = max(read(0, &inBuf, 65536), 0)");
+  emit_line("  if inLen == 0 {");
+  emit_line("   return 0");
+  emit_line("  }");
+  emit_line(" }");
+  emit_line(" inPos += 1");
+  emit_line(" return Int(inBuf[inPos - 1])");
+  emit_line("}");
+  emit_line("");
+}
+
 static void swift_emit_func_prologue(int func_id) {
   emit_line("");
   emit_line("private func func%d() {", func_id);
@@ -68,19 +107,15 @@ static void swift_emit_inst(Inst* inst) {
     break;
 
   case PUTC:
-    emit_line("print(\"\\(UnicodeScalar(%s)!)\", terminator:\"\")", src_str(inst));
+    emit_line("putByte(%s)", src_str(inst));
     break;
 
   case GETC:
-    emit_line("if true {");
-    inc_indent();
-    emit_line("let _c = getchar()");
-    emit_line("%s = _c == -1 ? 0 : Int(_c)", reg_names[inst->dst.reg]);
-    dec_indent();
-    emit_line("}");
+    emit_line("%s = getByte()", reg_names[inst->dst.reg]);
     break;
 
   case EXIT:
+    emit_line("flushOutput()");
     emit_line("exit(0)");
     break;
 
@@ -145,10 +180,11 @@ void target_swift(Module* module) {
     emit_line("private var %s: Int = 0", reg_names[i]);
   }
   emit_line("private var mem = [Int](repeating: 0, count: 1<<24)");
+  swift_emit_io();
 
   int num_inits = swift_init_state(module->data);
 
-  CHUNKED_FUNC_SIZE = 256;
+  set_default_chunked_func_size(256);
   int num_funcs = emit_chunked_main_loop(module->text,
                                          swift_emit_func_prologue,
                                          swift_emit_func_epilogue,
@@ -47,16 +47,92 @@ void dec_indent() {
   g_indent--;
 }
 
+// A line is formatted after its indent in g_line and written by one
+// fwrite, so emitting does not go through stdio a byte at a time.
+static char* g_line;
+static int g_line_cap;
+
 void emit_line(const char* fmt, ...) {
+  if (g_line_cap < g_indent + 256) {
+    g_line_cap = (g_indent + 256) * 2;
+    free(g_line);
+    g_line = (char*)malloc(g_line_cap);
+  }
+  int len = 0;
   if (fmt[0]) {
-    for (int i = 0; i < g_indent; i++)
-      putchar(' ');
     va_list ap;
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    va_list ap_cpy;
+    va_copy(ap_cpy, ap);
+    int room = g_line_cap - g_indent - 1;
+    int n = vsnprintf(g_line + g_indent, room, fmt, ap);
+    if (n >= room) {
+      g_line_cap = (g_indent + n + 2) * 2;
+      free(g_line);
+      g_line = (char*)malloc(g_line_cap);
+      vsnprintf(g_line + g_indent, n + 1, fmt, ap_cpy);
+    }
+    va_end(ap_cpy);
     va_end(ap);
+    memset(g_line, ' ', g_indent);
+    len = g_indent + n;
+  }
+  g_line[len++] = '\n';
+  fwrite(g_line, 1, len, stdout);
+}
+
+// Operand strings live in a scratch arena instead of one malloc each.
+// The main loop helpers call scratch_reset before every instruction, and
+// a string which has to outlive its instruction is copied by format.
+typedef struct ScratchBlock_ {
+  char* buf;
+  int used;
+  int cap;
+  struct ScratchBlock_* prev;
+} ScratchBlock;
+
+static ScratchBlock* g_scratch;
+
+void scratch_reset() {
+  while (g_scratch && g_scratch->prev) {
+    ScratchBlock* b = g_scratch->prev;
+    g_scratch->prev = b->prev;
+    free(b->buf);
+    free(b);
   }
-  putchar('\n');
+  if (g_scratch) {
+    g_scratch->used = 0;
+  }
+}
+
+static void scratch_add_block(int size) {
+  ScratchBlock* b = (ScratchBlock*)malloc(sizeof(ScratchBlock));
+  b->cap = size > 4096 ? size : 4096;
+  b->buf = (char*)malloc(b->cap);
+  b->used = 0;
+  b->prev = g_scratch;
+  g_scratch = b;
+}
+
+static const char* scratch_format(const char* fmt, ...) {
+  if (!g_scratch) {
+    scratch_add_block(0);
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  va_list ap_cpy;
+  va_copy(ap_cpy, ap);
+  int room = g_scratch->cap - g_scratch->used;
+  int n = vsnprintf(g_scratch->buf + g_scratch->used, room, fmt, ap) + 1;
+  if (n > room) {
+    scratch_add_block(n);
+    vsnprintf(g_scratch->buf, n, fmt, ap_cpy);
+  }
+  va_end(ap_cpy);
+  va_end(ap);
+  char* r = g_scratch->buf + g_scratch->used;
+  g_scratch->used += n;
+  return r;
 }
 
 static const char* DEFAULT_REG_NAMES[7] = {
@@ -69,7 +145,7 @@ const char* value_str(Value* v) {
   if (v->type == REG) {
     return reg_names[v->reg];
   } else if (v->type == IMM) {
-    return format("%d", v->imm);
+    return scratch_format("%d", v->imm);
   } else {
     error("invalid value");
   }
@@ -112,11 +188,14 @@ const char* cmp_str(Inst* inst, const char* true_str) {
     default:
       error("oops");
   }
-  return format("%s %s %s", reg_names[inst->dst.reg], op_str, src_str(inst));
+  return scratch_format("%s %s %s",
+                        reg_names[inst->dst.reg], op_str, src_str(inst));
 }
 
 static int g_emit_cnt;
 static bool g_emit_started;
+static char* g_emit_buf;
+static int g_emit_buf_cap;
 
 int emit_cnt() {
   return g_emit_cnt;
@@ -131,10 +210,70 @@ void emit_start() {
   g_emit_started = true;
 }
 
+void emit_buffer_start() {
+  emit_reset();
+  if (!g_emit_buf) {
+    g_emit_buf_cap = 65536;
+    g_emit_buf = (char*)malloc(g_emit_buf_cap);
+  }
+}
+
+void emit_buffer_flush() {
+  fwrite(g_emit_buf, 1, g_emit_cnt, stdout);
+  emit_reset();
+}
+
 void emit_1(int a) {
-  g_emit_cnt++;
-  if (g_emit_started)
+  if (g_emit_buf) {
+    if (g_emit_cnt == g_emit_buf_cap) {
+      char* buf = (char*)malloc(g_emit_buf_cap * 2);
+      memcpy(buf, g_emit_buf, g_emit_buf_cap);
+      free(g_emit_buf);
+      g_emit_buf = buf;
+      g_emit_buf_cap *= 2;
+    }
+    g_emit_buf[g_emit_cnt] = a;
+  } else if (g_emit_started) {
+#ifdef __eir__
     putchar(a);
+#else
+    // elc is single threaded, so stdout needs no locking.
+    putchar_unlocked(a);
+#endif
+  }
+  g_emit_cnt++;
+}
+
+void emit_patch_1(int addr, int a) {
+  g_emit_buf[addr] = a;
+}
+
+void emit_patch_le(int addr, uint32_t a) {
+  emit_patch_1(addr, a % 256);
+  a /= 256;
+  emit_patch_1(addr + 1, a % 256);
+  a /= 256;
+  emit_patch_1(addr + 2, a % 256);
+  a /= 256;
+  emit_patch_1(addr + 3, a);
+}
+
+void emit_patch_diff(int addr, uint32_t a, uint32_t b) {
+  uint32_t v = a - b;
+  emit_patch_1(addr, v % 256);
+  v /= 256;
+  emit_patch_1(addr + 1, v % 256);
+  v /= 256;
+  emit_patch_1(addr + 2, v % 256);
+  emit_patch_1(addr + 3, a >= b ? 0 : 0xff);
+}
+
+Reloc* add_reloc(Reloc* relocs, int addr, int pc) {
+  Reloc* r = (Reloc*)malloc(sizeof(Reloc));
+  r->addr = addr;
+  r->pc = pc;
+  r->next = relocs;
+  return r;
 }
 
 void emit_2(int a, int b) {
@@ -216,16 +355,571 @@ int emit_chunked_main_loop(Inst* inst,
     prev_pc = inst->pc;
     prev_func_id = func_id;
 
+    scratch_reset();
     emit_inst(inst);
   }
   emit_func_epilogue();
   return prev_func_id + 1;
 }
 
+int* split_chunks(Inst* text, int (*inst_size)(Inst* inst), int pc_size,
+                  int max_size, int* num_chunks) {
+  int num_pcs = 0;
+  for (Inst* inst = text; inst; inst = inst->next) {
+    num_pcs = inst->pc + 1;
+  }
+  int* sizes = calloc(num_pcs + 1, sizeof(int));
+  for (Inst* inst = text; inst; inst = inst->next) {
+    sizes[inst->pc] += inst_size(inst);
+  }
+
+  int* starts = malloc(sizeof(int) * (num_pcs + 1));
+  int n = 0;
+  int size = 0;
+  for (int pc = 0; pc < num_pcs; pc++) {
+    int pc_total = pc_size + sizes[pc];
+    if (pc % CHUNKED_FUNC_SIZE == 0 || size + pc_total > max_size) {
+      starts[n++] = pc;
+      size = 0;
+    }
+    size += pc_total;
+  }
+  starts[n] = num_pcs;
+  free(sizes);
+  *num_chunks = n;
+  return starts;
+}
+
+int emit_split_main_loop(Inst* inst, int* chunk_starts,
+                         void (*emit_func_prologue)(int func_id),
+                         void (*emit_func_epilogue)(void),
+                         void (*emit_pc_change)(int pc),
+                         void (*emit_inst)(Inst* inst)) {
+  int prev_pc = -1;
+  int func_id = -1;
+  for (; inst; inst = inst->next) {
+    if (prev_pc != inst->pc) {
+      if (func_id == -1 || inst->pc >= chunk_starts[func_id + 1]) {
+        if (func_id != -1) {
+          emit_func_epilogue();
+        }
+        func_id++;
+        emit_func_prologue(func_id);
+      }
+
+      emit_pc_change(inst->pc);
+    }
+    prev_pc = inst->pc;
+
+    scratch_reset();
+    emit_inst(inst);
+  }
+  emit_func_epilogue();
+  return func_id + 1;
+}
+
+// Rough bytecode sizes of the statements which the java and scala
+// backends emit, with registers in locals and memory in a static array.
+int jvm_inst_size(Inst* inst) {
+  switch (inst->op) {
+  case MOV:
+    return 5;
+  case ADD:
+  case SUB:
+    return 12;
+  case LOAD:
+  case STORE:
+  case PUTC:
+    return 14;
+  case GETC:
+    return 40;
+  case EXIT:
+    return 8;
+  case DUMP:
+    return 0;
+  default:
+    return 16;
+  }
+}
+
+bool* find_indirect_targets(Module* module, int num_pcs) {
+  bool* targets = calloc(num_pcs + 1, sizeof(bool));
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (inst->src.type == IMM && inst->src.imm < num_pcs) {
+      targets[inst->src.imm] = true;
+    }
+  }
+  for (Data* data = module->data; data; data = data->next) {
+    if (data->v >= 0 && data->v < num_pcs) {
+      targets[data->v] = true;
+    }
+  }
+  return targets;
+}
+
+// Structured control flow (a stackifier) for the JavaScript backends.
+//
+// Entries are the pcs which the pc dispatch switch of a chunk can enter:
+// the start of the chunk, targets of jumps from other chunks, and targets
+// of register jumps as given by find_indirect_targets. The pcs from an
+// entry up to the next one form a region. Jumps inside a region become a
+// labeled loop (backward) or a labeled block (forward) around the code,
+// and jumps to a later entry break out of the block which the dispatch
+// breaks to. Targets which would make the scopes overlap become entries
+// as well, so any control flow falls back to setting pc and going
+// through the switch. A register jump may still land on another pc, as
+// code addresses can be computed, so in programs with register jumps the
+// default of the switch runs the other pcs of the chunk one by one, with
+// every jump going through the switch.
+static int g_st_num_pcs;
+static bool g_st_has_reg_jump;
+static bool g_st_unstructured;
+static bool* g_st_entry;
+static int* g_st_region;
+static int* g_st_loop_end;
+static int* g_st_block_open;
+static int g_st_lo;
+static int g_st_hi;
+
+static bool st_is_jump(Inst* inst) {
+  return inst->op >= JEQ && inst->op <= JMP;
+}
+
+static bool st_in_chunk(Inst* inst) {
+  return (st_is_jump(inst) && inst->jmp.type == IMM &&
+          g_st_lo <= inst->jmp.imm && inst->jmp.imm < g_st_hi);
+}
+
+static void st_find_entries(Module* module) {
+  g_st_num_pcs = 0;
+  g_st_has_reg_jump = false;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    g_st_num_pcs = inst->pc + 1;
+    if (st_is_jump(inst) && inst->jmp.type == REG) {
+      g_st_has_reg_jump = true;
+    }
+  }
+  g_st_entry = find_indirect_targets(module, g_st_num_pcs);
+  g_st_region = calloc(g_st_num_pcs + 1, sizeof(int));
+  g_st_loop_end = calloc(g_st_num_pcs + 1, sizeof(int));
+  g_st_block_open = calloc(g_st_num_pcs + 1, sizeof(int));
+
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (inst->pc % CHUNKED_FUNC_SIZE == 0) {
+      g_st_entry[inst->pc] = true;
+    }
+    if (st_is_jump(inst) && inst->jmp.type == IMM &&
+        inst->jmp.imm < g_st_num_pcs &&
+        inst->jmp.imm / CHUNKED_FUNC_SIZE != inst->pc / CHUNKED_FUNC_SIZE) {
+      g_st_entry[inst->jmp.imm] = true;
+    }
+  }
+}
+
+static void st_analyze_chunk(Inst* first) {
+  for (;;) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int pc = g_st_lo; pc < g_st_hi; pc++) {
+        g_st_region[pc] = g_st_entry[pc] ? pc : g_st_region[pc - 1];
+      }
+      for (Inst* inst = first; inst && inst->pc < g_st_hi; inst = inst->next) {
+        int t = inst->jmp.imm;
+        if (st_in_chunk(inst) && !g_st_entry[t] &&
+            g_st_region[t] != g_st_region[inst->pc]) {
+          g_st_entry[t] = true;
+          changed = true;
+        }
+      }
+    }
+
+    for (int pc = g_st_lo; pc < g_st_hi; pc++) {
+      g_st_loop_end[pc] = -1;
+      g_st_block_open[pc] = -1;
+    }
+    for (Inst* inst = first; inst && inst->pc < g_st_hi; inst = inst->next) {
+      int s = inst->pc;
+      int t = inst->jmp.imm;
+      if (!st_in_chunk(inst) || g_st_region[t] != g_st_region[s]) {
+        continue;
+      }
+      if (t <= s) {
+        if (g_st_loop_end[t] < s)
+          g_st_loop_end[t] = s;
+      } else if (g_st_block_open[t] < 0 || g_st_block_open[t] > s) {
+        g_st_block_open[t] = s;
+      }
+    }
+
+    // Make the scopes nest. Loops end and blocks open as late as their
+    // jumps allow, and are widened until they do not overlap. A block
+    // which would have to enter a loop from outside is given up.
+    bool promoted = false;
+    changed = true;
+    while (changed && !promoted) {
+      changed = false;
+      for (int t1 = g_st_lo; t1 < g_st_hi; t1++) {
+        if (g_st_loop_end[t1] < 0)
+          continue;
+        for (int t2 = t1 + 1; t2 <= g_st_loop_end[t1]; t2++) {
+          if (g_st_loop_end[t2] > g_st_loop_end[t1]) {
+            g_st_loop_end[t1] = g_st_loop_end[t2];
+            changed = true;
+          }
+        }
+      }
+      for (int t2 = g_st_lo; t2 < g_st_hi && !promoted; t2++) {
+        int o2 = g_st_block_open[t2];
+        if (o2 < 0)
+          continue;
+        for (int t1 = g_st_lo; t1 < t2; t1++) {
+          int o1 = g_st_block_open[t1];
+          if (o1 >= 0 && o1 < o2 && o2 < t1) {
+            g_st_block_open[t2] = o2 = o1;
+            changed = true;
+          }
+        }
+        for (int lt = g_st_lo; lt < g_st_hi; lt++) {
+          int le = g_st_loop_end[lt];
+          if (le < 0)
+            continue;
+          if (o2 < lt && lt < t2 && t2 <= le) {
+            g_st_entry[t2] = true;
+            promoted = true;
+            break;
+          }
+          if (lt < o2 && o2 <= le && le < t2 - 1) {
+            g_st_block_open[t2] = o2 = lt;
+            changed = true;
+          }
+        }
+      }
+    }
+    if (!promoted)
+      return;
+  }
+}
+
+const char* structured_jump_str(Inst* inst) {
+  int s = inst->pc;
+  if (inst->jmp.type == REG) {
+    return format("{ pc = %s; continue dispatch; }",
+                  reg_names[inst->jmp.reg]);
+  }
+  int t = inst->jmp.imm;
+  if (!st_in_chunk(inst)) {
+    return format("{ pc = %d; break dispatch; }", t);
+  }
+  if (g_st_unstructured) {
+    return format("{ pc = %d; continue dispatch; }", t);
+  }
+  if (t > s) {
+    return format("break b%d;", t);
+  }
+  if (g_st_region[t] == g_st_region[s]) {
+    return format("continue l%d;", t);
+  }
+  return format("{ pc = %d; continue dispatch; }", t);
+}
+
+// Loops and blocks of the current chunk in the order they open: by
+// start, then outermost first. A block goes outside a loop with the same
+// extent.
+static int g_st_num_scopes;
+static int* g_st_scope_start;
+static int* g_st_scope_end;
+static bool* g_st_scope_loop;
+
+static bool st_scope_before(int start, int end, bool loop, int i) {
+  if (start != g_st_scope_start[i])
+    return start < g_st_scope_start[i];
+  if (end != g_st_scope_end[i])
+    return end > g_st_scope_end[i];
+  return !loop && g_st_scope_loop[i];
+}
+
+static void st_add_scope(int start, int end, bool loop) {
+  int i = g_st_num_scopes++;
+  for (; i > 0 && st_scope_before(start, end, loop, i - 1); i--) {
+    g_st_scope_start[i] = g_st_scope_start[i - 1];
+    g_st_scope_end[i] = g_st_scope_end[i - 1];
+    g_st_scope_loop[i] = g_st_scope_loop[i - 1];
+  }
+  g_st_scope_start[i] = start;
+  g_st_scope_end[i] = end;
+  g_st_scope_loop[i] = loop;
+}
+
+static void st_collect_scopes(void) {
+  if (!g_st_scope_start) {
+    g_st_scope_start = malloc(sizeof(int) * CHUNKED_FUNC_SIZE * 2);
+    g_st_scope_end = malloc(sizeof(int) * CHUNKED_FUNC_SIZE * 2);
+    g_st_scope_loop = malloc(sizeof(bool) * CHUNKED_FUNC_SIZE * 2);
+  }
+  g_st_num_scopes = 0;
+  for (int pc = g_st_lo; pc < g_st_hi; pc++) {
+    if (g_st_loop_end[pc] >= 0)
+      st_add_scope(pc, g_st_loop_end[pc], true);
+    if (g_st_block_open[pc] >= 0)
+      st_add_scope(g_st_block_open[pc], pc - 1, false);
+  }
+}
+
+// Emits the pcs of the current chunk which are not entries as the cases
+// of a switch on pc, falling through to the next pc.
+static void st_emit_unstructured(Inst* inst,
+                                 void (*emit_inst)(Inst* inst)) {
+  g_st_unstructured = true;
+  emit_line("switch (pc | 0) {");
+  inc_indent();
+  int prev_pc = -1;
+  for (; inst && inst->pc < g_st_hi; inst = inst->next) {
+    int pc = inst->pc;
+    if (g_st_entry[pc]) {
+      if (prev_pc >= 0 && !g_st_entry[prev_pc]) {
+        emit_line("pc = %d; continue dispatch;", pc);
+      }
+    } else {
+      if (prev_pc != pc) {
+        dec_indent();
+        emit_line("case %d:", pc);
+        inc_indent();
+      }
+      scratch_reset();
+      emit_inst(inst);
+    }
+    prev_pc = pc;
+  }
+  if (prev_pc >= 0 && !g_st_entry[prev_pc]) {
+    emit_line("pc = %d; break dispatch;", prev_pc + 1);
+  }
+  dec_indent();
+  emit_line("}");
+  g_st_unstructured = false;
+}
+
+static void st_close_scope(int i) {
+  if (g_st_scope_loop[i])
+    emit_line("break;");
+  dec_indent();
+  emit_line("}");
+}
+
+int emit_structured_main_loop(Module* module,
+                              void (*emit_func_prologue)(int func_id),
+                              void (*emit_func_epilogue)(void),
+                              void (*emit_inst)(Inst* inst)) {
+  st_find_entries(module);
+  int num_funcs = 0;
+  Inst* inst = module->text;
+  while (inst) {
+    int func_id = inst->pc / CHUNKED_FUNC_SIZE;
+    g_st_lo = inst->pc;
+    g_st_hi = (func_id + 1) * CHUNKED_FUNC_SIZE;
+    if (g_st_hi > g_st_num_pcs)
+      g_st_hi = g_st_num_pcs;
+    st_analyze_chunk(inst);
+    st_collect_scopes();
+
+    emit_func_prologue(func_id);
+    emit_line("dispatch: while (1) {");
+    inc_indent();
+    for (int pc = g_st_hi - 1; pc >= g_st_lo; pc--) {
+      if (g_st_entry[pc]) {
+        emit_line("b%d: {", pc);
+        inc_indent();
+      }
+    }
+    emit_line("switch (pc | 0) {");
+    for (int pc = g_st_lo; pc < g_st_hi; pc++) {
+      if (g_st_entry[pc])
+        emit_line("case %d: break b%d;", pc, pc);
+    }
+    emit_line("default:");
+    inc_indent();
+    if (g_st_has_reg_jump) {
+      st_emit_unstructured(inst, emit_inst);
+    }
+    // A register jump to another chunk, or past the end of the program.
+    emit_line("if ((pc | 0) < %d) break dispatch;", g_st_num_pcs);
+    emit_line("running = 0; break dispatch;");
+    dec_indent();
+    emit_line("}");
+
+    int* open = malloc(sizeof(int) * (g_st_num_scopes + 1));
+    int depth = 0;
+    int next = 0;
+    int prev_pc = -1;
+    for (; inst && inst->pc < g_st_hi; inst = inst->next) {
+      int pc = inst->pc;
+      if (prev_pc != pc) {
+        while (depth && g_st_scope_end[open[depth - 1]] < pc) {
+          st_close_scope(open[--depth]);
+        }
+        if (g_st_entry[pc]) {
+          dec_indent();
+          emit_line("}");
+        }
+        emit_line("");
+        emit_line("// pc %d", pc);
+        for (; next < g_st_num_scopes && g_st_scope_start[next] == pc;
+             next++) {
+          if (g_st_scope_loop[next]) {
+            emit_line("l%d: while (1) {", pc);
+          } else {
+            emit_line("b%d: {", g_st_scope_end[next] + 1);
+          }
+          inc_indent();
+          open[depth++] = next;
+        }
+      }
+      prev_pc = pc;
+      scratch_reset();
+      emit_inst(inst);
+    }
+    while (depth) {
+      st_close_scope(open[--depth]);
+    }
+    free(open);
+
+    emit_line("pc = %d;", prev_pc + 1);
+    emit_line("break;");
+    dec_indent();
+    emit_line("}");
+    emit_func_epilogue();
+    num_funcs = func_id + 1;
+  }
+  return num_funcs;
+}
+
+int data_size(Data* data) {
+  int n = 0;
+  for (int mp = 1; data; data = data->next, mp++) {
+    if (data->v)
+      n = mp;
+  }
+  return n;
+}
+
+void emit_data_words(Data* data) {
+  char buf[256];
+  int n = data_size(data);
+  int len = 0;
+  for (int mp = 0; mp < n; data = data->next, mp++) {
+    len += sprintf(buf + len, "%d,", data->v);
+    if (mp % 16 == 15 || mp == n - 1) {
+      emit_line("%s", buf);
+      len = 0;
+    }
+  }
+}
+
+static const char BASE64_CHARS[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void emit_data_base64(Data* data) {
+  char buf[80];
+  int n = data_size(data);
+  int len = 0;
+  buf[len++] = '"';
+  for (int mp = 0; mp < n; data = data->next, mp++) {
+    int v = data->v;
+    buf[len++] = BASE64_CHARS[v >> 18 & 63];
+    buf[len++] = BASE64_CHARS[v >> 12 & 63];
+    buf[len++] = BASE64_CHARS[v >> 6 & 63];
+    buf[len++] = BASE64_CHARS[v & 63];
+    if (mp % 16 == 15 || mp == n - 1) {
+      buf[len++] = '"';
+      buf[len++] = ',';
+      buf[len] = 0;
+      emit_line("%s", buf);
+      len = 0;
+      buf[len++] = '"';
+    }
+  }
+}
+
+int MEM_BUDGET = 0;
+
+int mem_size_bits(Data* data) {
+  if (!MEM_BUDGET)
+    return 24;
+  int need = data_size(data) + MEM_BUDGET;
+  int bits = 1;
+  while (bits < 24 && (1 << bits) < need)
+    bits++;
+  return bits;
+}
+
+bool SPARSE_MEM = false;
+
+bool use_sparse_mem(void) {
+  return SPARSE_MEM;
+}
+
+const char* mem_index_str(const char* addr, int bits) {
+  if (bits == 24)
+    return addr;
+  return scratch_format("%s & %d", addr, (1 << bits) - 1);
+}
+
 #define PACK2(x) ((x) % 256), ((x) / 256)
 #define PACK4(x) ((x) % 256), ((x) / 256 % 256), ((x) / 65536), 0
 
-void emit_elf_header(uint16_t machine, uint32_t filesz) {
+// The initial memory image is stored in the file right after the text
+// and mapped as a writable segment one page above it, so the two
+// segments never share a page. The segment is extended to cover the
+// whole 1<<24 words of the VM memory and the kernel fills the rest
+// with zeros, so no copy or extra mmap is needed at start-up.
+int elf_data_addr(uint32_t filesz) {
+  return ELF_TEXT_START + ELF_HEADER_SIZE + filesz + 0x1000;
+}
+
+static int elf_data_filesz(Data* data) {
+  return data_size(data) * 4;
+}
+
+bool ELF_SYMTAB = false;
+const char* ELF_PERF_MAP = NULL;
+
+static const char ELF_SHSTRTAB[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+
+// Local labels such as .L123 would split functions into pieces, so only
+// the other labels become symbols.
+static bool is_elf_symbol(Label* label) {
+  return label->name[0] != '.';
+}
+
+static int elf_strtab_size(Module* module) {
+  int n = 1;
+  for (Label* label = module->labels; label; label = label->next) {
+    if (is_elf_symbol(label))
+      n += strlen(label->name) + 1;
+  }
+  return n;
+}
+
+static int elf_symtab_size(Module* module) {
+  int n = 1;
+  for (Label* label = module->labels; label; label = label->next) {
+    if (is_elf_symbol(label))
+      n++;
+  }
+  return n * 16;
+}
+
+static int elf_shoff(uint32_t filesz, Module* module) {
+  int off = (ELF_HEADER_SIZE + filesz + elf_data_filesz(module->data) +
+             elf_symtab_size(module) + elf_strtab_size(module) +
+             sizeof(ELF_SHSTRTAB));
+  return (off + 3) / 4 * 4;
+}
+
+void emit_elf_header(uint16_t machine, uint32_t filesz, Module* module) {
+  Data* data = module->data;
+  int shoff = ELF_SYMTAB ? elf_shoff(filesz, module) : 0;
+  int shnum = ELF_SYMTAB ? 5 : 0;
   const char ehdr[52] = {
     // e_ident
     0x7f, 0x45, 0x4c, 0x46, 0x01, 0x01, 0x01, 0x00,
@@ -235,16 +929,16 @@ void emit_elf_header(uint16_t machine, uint32_t filesz) {
     PACK4(1),  // e_version
     PACK4(ELF_TEXT_START + ELF_HEADER_SIZE),  // e_entry
     PACK4(52),  // e_phoff
-    PACK4(0),  // e_shoff
+    PACK4(shoff),  // e_shoff
     PACK4(0),  // e_flags
     PACK2(52),  // e_ehsize
     PACK2(32),  // e_phentsize
-    PACK2(1),  // e_phnum
+    PACK2(2),  // e_phnum
     PACK2(40),  // e_shentsize
-    PACK2(0),  // e_shnum
-    PACK2(0),  // e_shstrndx
+    PACK2(shnum),  // e_shnum
+    PACK2(shnum ? shnum - 1 : 0),  // e_shstrndx
   };
-  const char phdr[32] = {
+  const char text_phdr[32] = {
     PACK4(1),  // p_type
     PACK4(0),  // p_offset
     PACK4(ELF_TEXT_START),  // p_vaddr
@@ -254,17 +948,470 @@ void emit_elf_header(uint16_t machine, uint32_t filesz) {
     PACK4(5),  // p_flags
     PACK4(0x1000),  // p_align
   };
+  const char data_phdr[32] = {
+    PACK4(1),  // p_type
+    PACK4(filesz + ELF_HEADER_SIZE),  // p_offset
+    PACK4(elf_data_addr(filesz)),  // p_vaddr
+    PACK4(elf_data_addr(filesz)),  // p_paddr
+    PACK4(elf_data_filesz(data)),  // p_filesz
+    0, 0, 0, 4,  // p_memsz (1<<26)
+    PACK4(6),  // p_flags
+    PACK4(0x1000),  // p_align
+  };
   fwrite(ehdr, 52, 1, stdout);
-  fwrite(phdr, 32, 1, stdout);
+  fwrite(text_phdr, 32, 1, stdout);
+  fwrite(data_phdr, 32, 1, stdout);
+}
+
+void emit_elf_data(Data* data) {
+  int n = elf_data_filesz(data) / 4;
+  for (int mp = 0; mp < n; data = data->next, mp++) {
+    emit_le(data->v);
+  }
+}
+
+// A label after the last instruction is at the end of the text.
+static int label_addr(Label* label, int* pc2addr, int num_pcs,
+                      int text_end) {
+  if (label->pc >= num_pcs)
+    return text_end;
+  return ELF_TEXT_START + ELF_HEADER_SIZE + pc2addr[label->pc];
+}
+
+static void emit_elf_shdr(int name, int type, int flags, int addr, int offset,
+                          int size, int link, int info, int align,
+                          int entsize) {
+  emit_le(name);
+  emit_le(type);
+  emit_le(flags);
+  emit_le(addr);
+  emit_le(offset);
+  emit_le(size);
+  emit_le(link);
+  emit_le(info);
+  emit_le(align);
+  emit_le(entsize);
+}
+
+static void emit_elf_symtab(Module* module, uint32_t filesz, int* pc2addr) {
+  int symtab_off = ELF_HEADER_SIZE + filesz + elf_data_filesz(module->data);
+  int symtab_size = elf_symtab_size(module);
+  int strtab_size = elf_strtab_size(module);
+  int text_end = ELF_TEXT_START + ELF_HEADER_SIZE + filesz;
+  int num_pcs = 0;
+  for (Inst* inst = module->text; inst; inst = inst->next)
+    num_pcs = inst->pc + 1;
+
+  for (int i = 0; i < 16; i++)
+    emit_1(0);
+  int name = 1;
+  for (Label* label = module->labels; label; label = label->next) {
+    if (!is_elf_symbol(label))
+      continue;
+    Label* next = label->next;
+    while (next && !is_elf_symbol(next))
+      next = next->next;
+    int addr = label_addr(label, pc2addr, num_pcs, text_end);
+    int end = next ? label_addr(next, pc2addr, num_pcs, text_end) : text_end;
+    emit_le(name);
+    emit_le(addr);
+    emit_le(end - addr);
+    emit_1(0x12);  // STB_GLOBAL | STT_FUNC
+    emit_1(0);
+    emit_2(1, 0);  // .text
+    name += strlen(label->name) + 1;
+  }
+
+  emit_1(0);
+  for (Label* label = module->labels; label; label = label->next) {
+    if (!is_elf_symbol(label))
+      continue;
+    for (const char* p = label->name; *p; p++)
+      emit_1(*p);
+    emit_1(0);
+  }
+
+  for (int i = 0; i < (int)sizeof(ELF_SHSTRTAB); i++)
+    emit_1(ELF_SHSTRTAB[i]);
+  while ((ELF_HEADER_SIZE + emit_cnt()) % 4)
+    emit_1(0);
+
+  int strtab_off = symtab_off + symtab_size;
+  int shstrtab_off = strtab_off + strtab_size;
+  emit_elf_shdr(0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  emit_elf_shdr(1, 1, 6, ELF_TEXT_START + ELF_HEADER_SIZE, ELF_HEADER_SIZE,
+                filesz, 0, 0, 1, 0);
+  emit_elf_shdr(7, 2, 0, 0, symtab_off, symtab_size, 3, 1, 4, 16);
+  emit_elf_shdr(15, 3, 0, 0, strtab_off, strtab_size, 0, 0, 1, 0);
+  emit_elf_shdr(23, 3, 0, 0, shstrtab_off, sizeof(ELF_SHSTRTAB), 0, 0, 1, 0);
+}
+
+// Writes a perf map style table ("START SIZE NAME" in hex) which maps
+// the code of every pc to the enclosing label and its line in the EIR.
+static void write_elf_perf_map(Module* module, uint32_t filesz,
+                               int* pc2addr) {
+  FILE* fp = fopen(ELF_PERF_MAP, "w");
+  if (!fp)
+    error("cannot open %s", ELF_PERF_MAP);
+
+  Label* label = NULL;
+  Label* next_label = module->labels;
+  Inst* first = NULL;
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    if (!first || first->pc != inst->pc)
+      first = inst;
+    if (inst->next && inst->next->pc == inst->pc)
+      continue;
+    while (next_label && next_label->pc <= inst->pc) {
+      if (is_elf_symbol(next_label))
+        label = next_label;
+      next_label = next_label->next;
+    }
+    int addr = pc2addr[inst->pc];
+    int end = inst->next ? pc2addr[inst->next->pc] : (int)filesz;
+    fprintf(fp, "%x %x %s:%d\n", ELF_TEXT_START + ELF_HEADER_SIZE + addr,
+            end - addr, label ? label->name : "_start", first->lineno);
+  }
+  fclose(fp);
+}
+
+void emit_elf_symbols(Module* module, uint32_t filesz, int* pc2addr) {
+  if (ELF_SYMTAB)
+    emit_elf_symtab(module, filesz, pc2addr);
+  if (ELF_PERF_MAP)
+    write_elf_perf_map(module, filesz, pc2addr);
+}
+
+bool handle_elf_args(const char* key, const char* value) {
+  if (!strcmp(key, "symtab")) {
+    ELF_SYMTAB = parse_bool_value(value);
+    return true;
+  }
+  if (!strcmp(key, "perf_map")) {
+    ELF_PERF_MAP = value;
+    return true;
+  }
+  return false;
+}
+
+void emit_uleb128(uint32_t v) {
+  while (v >= 128) {
+    emit_1(v % 128 + 128);
+    v /= 128;
+  }
+  emit_1(v);
+}
+
+void emit_wasm_i32_const(uint32_t v) {
+  emit_1(0x41);
+  // Signed LEB128 of a non-negative value: stop once the sign bit is 0.
+  while (v >= 64) {
+    emit_1(v % 128 + 128);
+    v /= 128;
+  }
+  emit_1(v);
+}
+
+void emit_wasm_name(const char* name) {
+  emit_uleb128(strlen(name));
+  for (; *name; name++)
+    emit_1(*name);
+}
+
+// Sizes are padded to 5 bytes of LEB128 so they can be patched in place.
+int emit_wasm_size_start() {
+  int addr = emit_cnt();
+  emit_5(0x80, 0x80, 0x80, 0x80, 0);
+  return addr;
+}
+
+int emit_wasm_section_start(int id) {
+  emit_1(id);
+  return emit_wasm_size_start();
+}
+
+void emit_wasm_size_end(int addr) {
+  int size = emit_cnt() - addr - 5;
+  for (int i = 0; i < 4; i++) {
+    emit_patch_1(addr + i, size % 128 + 128);
+    size /= 128;
+  }
+  emit_patch_1(addr + 4, size);
+}
+
+int wasm_num_chunks(Inst* text) {
+  int num_pcs = 0;
+  for (; text; text = text->next)
+    num_pcs = text->pc + 1;
+  return (num_pcs + CHUNKED_FUNC_SIZE - 1) / CHUNKED_FUNC_SIZE;
+}
+
+void emit_wasm_globals(int num_globals) {
+  int addr = emit_wasm_section_start(6);
+  emit_uleb128(num_globals);
+  for (int i = 0; i < num_globals; i++) {
+    // mutable i32 = i32.const 0
+    emit_4(0x7f, 1, 0x41, 0);
+    emit_1(0x0b);
+  }
+  emit_wasm_size_end(addr);
+}
+
+void emit_wasm_table(int num_chunks) {
+  int addr = emit_wasm_section_start(4);
+  // One funcref table with a fixed size.
+  emit_2(1, 0x70);
+  emit_1(1);
+  emit_uleb128(num_chunks);
+  emit_uleb128(num_chunks);
+  emit_wasm_size_end(addr);
+}
+
+void emit_wasm_elem(int first_chunk, int num_chunks) {
+  int addr = emit_wasm_section_start(9);
+  // Table 0 from offset 0.
+  emit_4(1, 0, 0x41, 0);
+  emit_1(0x0b);
+  emit_uleb128(num_chunks);
+  for (int i = 0; i < num_chunks; i++)
+    emit_uleb128(first_chunk + i);
+  emit_wasm_size_end(addr);
+}
+
+static int g_wasm_num_pcs;
+static int g_wasm_chunk_end;
+static int g_wasm_depth;
+static int g_wasm_func_addr;
+
+void emit_wasm_value(Value* v) {
+  if (v->type == REG) {
+    emit_2(0x20, v->reg);
+  } else if (v->type == IMM) {
+    emit_wasm_i32_const(v->imm);
+  } else {
+    error("invalid value");
+  }
+}
+
+static void emit_wasm_cmp(Inst* inst) {
+  emit_2(0x20, inst->dst.reg);
+  emit_wasm_value(&inst->src);
+  switch (normalize_cond(inst->op, false)) {
+    case JEQ: emit_1(0x46); break;
+    case JNE: emit_1(0x47); break;
+    case JLT: emit_1(0x49); break;
+    case JGT: emit_1(0x4b); break;
+    case JLE: emit_1(0x4d); break;
+    case JGE: emit_1(0x4f); break;
+    default: error("oops");
+  }
+}
+
+// The dispatch is a br_table over one nested block per pc, and the code
+// of a pc follows the end of its block. g_wasm_depth counts the blocks
+// between the current code and the loop which redispatches.
+static void emit_wasm_func_prologue(int func_id) {
+  int base = func_id * CHUNKED_FUNC_SIZE;
+  int num_cases = g_wasm_num_pcs - base;
+  if (num_cases > CHUNKED_FUNC_SIZE)
+    num_cases = CHUNKED_FUNC_SIZE;
+  g_wasm_chunk_end = base + num_cases;
+  g_wasm_depth = num_cases + 1;
+
+  g_wasm_func_addr = emit_wasm_size_start();
+  // 7 i32 locals.
+  emit_3(1, 7, 0x7f);
+  for (int i = 0; i < 7; i++) {
+    // local.set i (global.get i)
+    emit_4(0x23, i, 0x21, i);
+  }
+  // loop, block $out, and a block per pc.
+  emit_2(0x03, 0x40);
+  for (int i = 0; i <= num_cases; i++)
+    emit_2(0x02, 0x40);
+  emit_2(0x20, 6);
+  emit_wasm_i32_const(base);
+  emit_1(0x6b);
+  emit_1(0x0e);
+  emit_uleb128(num_cases);
+  for (int i = 0; i <= num_cases; i++)
+    emit_uleb128(i);
+}
+
+static void emit_wasm_func_epilogue(void) {
+  emit_wasm_i32_const(g_wasm_chunk_end);
+  emit_2(0x21, 6);
+  // end $out
+  emit_1(0x0b);
+  for (int i = 0; i < 7; i++) {
+    // global.set i (local.get i)
+    emit_4(0x20, i, 0x24, i);
+  }
+  // end loop, end func
+  emit_2(0x0b, 0x0b);
+  emit_wasm_size_end(g_wasm_func_addr);
+}
+
+static void emit_wasm_pc_change(int pc) {
+  emit_1(0x0b);
+  // $out and the blocks of the following pcs are still open.
+  g_wasm_depth = g_wasm_chunk_end - pc;
+}
+
+static void (*g_wasm_emit_io)(Inst* inst);
+
+static void emit_wasm_inst(Inst* inst) {
+  switch (inst->op) {
+  case MOV:
+    emit_wasm_value(&inst->src);
+    emit_2(0x21, inst->dst.reg);
+    break;
+
+  case ADD:
+  case SUB:
+    emit_2(0x20, inst->dst.reg);
+    emit_wasm_value(&inst->src);
+    emit_1(inst->op == ADD ? 0x6a : 0x6b);
+    emit_wasm_i32_const(UINT_MAX);
+    emit_1(0x71);
+    emit_2(0x21, inst->dst.reg);
+    break;
+
+  case LOAD:
+    emit_wasm_value(&inst->src);
+    emit_wasm_i32_const(2);
+    emit_1(0x74);
+    emit_3(0x28, 2, 0);
+    emit_2(0x21, inst->dst.reg);
+    break;
+
+  case STORE:
+    emit_wasm_value(&inst->src);
+    emit_wasm_i32_const(2);
+    emit_1(0x74);
+    emit_2(0x20, inst->dst.reg);
+    emit_3(0x36, 2, 0);
+    break;
+
+  case PUTC:
+  case GETC:
+  case EXIT:
+    g_wasm_emit_io(inst);
+    break;
+
+  case DUMP:
+    break;
+
+  case EQ:
+  case NE:
+  case LT:
+  case GT:
+  case LE:
+  case GE:
+    emit_wasm_cmp(inst);
+    emit_2(0x21, inst->dst.reg);
+    break;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    emit_wasm_cmp(inst);
+    emit_2(0x04, 0x40);
+    emit_wasm_value(&inst->jmp);
+    emit_2(0x21, 6);
+    emit_1(0x0c);
+    emit_uleb128(g_wasm_depth + 1);
+    emit_1(0x0b);
+    break;
+
+  case JMP:
+    emit_wasm_value(&inst->jmp);
+    emit_2(0x21, 6);
+    emit_1(0x0c);
+    emit_uleb128(g_wasm_depth);
+    break;
+
+  default:
+    error("oops");
+  }
+}
+
+int emit_wasm_code(Inst* text, void (*emit_io)(Inst* inst),
+                   int num_extra_funcs) {
+  g_wasm_num_pcs = 0;
+  for (Inst* inst = text; inst; inst = inst->next)
+    g_wasm_num_pcs = inst->pc + 1;
+  g_wasm_emit_io = emit_io;
+
+  int addr = emit_wasm_section_start(10);
+  emit_uleb128(wasm_num_chunks(text) + 1 + num_extra_funcs);
+  emit_chunked_main_loop(text,
+                         emit_wasm_func_prologue,
+                         emit_wasm_func_epilogue,
+                         emit_wasm_pc_change,
+                         emit_wasm_inst);
+
+  // The main loop: call_indirect (pc / CHUNKED_FUNC_SIZE) forever.
+  int func_addr = emit_wasm_size_start();
+  emit_1(0);
+  emit_4(0x03, 0x40, 0x23, 6);
+  emit_wasm_i32_const(CHUNKED_FUNC_SIZE);
+  emit_1(0x6e);
+  emit_3(0x11, 0, 0);
+  emit_2(0x0c, 0);
+  emit_2(0x0b, 0x0b);
+  emit_wasm_size_end(func_addr);
+  return addr;
+}
+
+void emit_wasm_data_segment(Data* data) {
+  int n = data_size(data);
+  // Memory 0 at i32.const 0.
+  emit_4(0, 0x41, 0, 0x0b);
+  emit_uleb128(n * 4);
+  for (int mp = 0; mp < n; data = data->next, mp++) {
+    emit_le(data->v);
+  }
+}
+
+bool handle_mem_budget_arg(const char* key, const char* value) {
+  if (!strcmp(key, "mem_budget")) {
+    MEM_BUDGET = atoi(value);
+    return true;
+  }
+  return false;
+}
+
+bool handle_sparse_mem_args(const char* key, const char* value) {
+  if (!strcmp(key, "sparse_mem")) {
+    SPARSE_MEM = parse_bool_value(value);
+    return true;
+  }
+  return handle_mem_budget_arg(key, value);
 }
 
 bool parse_bool_value(const char* value) {
   return *value == '1' || *value == 't' || *value == 'T';
 }
 
+static bool chunked_func_size_given;
+
+void set_default_chunked_func_size(int size) {
+  if (!chunked_func_size_given) {
+    CHUNKED_FUNC_SIZE = size;
+  }
+}
+
 bool handle_chunked_func_size_arg(const char* key, const char* value) {
   if (!strcmp(key, "chunked_func_size")) {
     CHUNKED_FUNC_SIZE = atoi(value);
+    if (CHUNKED_FUNC_SIZE <= 0) {
+      error("chunked_func_size must be positive: %s", value);
+    }
+    chunked_func_size_given = true;
     return true;
   }
   return false;
@@ -11,7 +11,7 @@ typedef uint32_t uint;
 typedef uint8_t byte;
 
 static const int ELF_TEXT_START = 0x100000;
-static const int ELF_HEADER_SIZE = 84;
+static const int ELF_HEADER_SIZE = 116;
 
 char* vformat(const char* fmt, va_list ap);
 char* format(const char* fmt, ...);
@@ -27,6 +27,10 @@ void emit_line(const char* fmt, ...);
 
 Op normalize_cond(Op op, bool flip);
 extern const char** reg_names;
+// value_str, src_str, cmp_str and mem_index_str return strings in a
+// scratch arena which is reset by scratch_reset, and by the main loop
+// helpers before each instruction. Use format to keep one for longer.
+void scratch_reset();
 const char* value_str(Value* v);
 const char* src_str(Inst* inst);
 const char* cmp_str(Inst* inst, const char* true_str);
@@ -35,6 +39,27 @@ int emit_cnt();
 void emit_reset();
 void emit_start();
 void emit_1(int a);
+// In buffered mode, emitted bytes are kept in memory so they can be
+// patched by emit_patch_* before a single emit_buffer_flush.
+void emit_buffer_start();
+void emit_buffer_flush();
+void emit_patch_1(int addr, int a);
+void emit_patch_le(int addr, uint32_t a);
+void emit_patch_diff(int addr, uint32_t a, uint32_t b);
+
+// A location in the code buffer to be patched once all code is emitted.
+// |pc| is the target of a jump or one of RELOC_RODATA and RELOC_DATA.
+typedef struct Reloc_ {
+  int addr;
+  int pc;
+  struct Reloc_* next;
+} Reloc;
+
+enum {
+  RELOC_RODATA = -1, RELOC_DATA = -2
+};
+
+Reloc* add_reloc(Reloc* relocs, int addr, int pc);
 void emit_2(int a, int b);
 void emit_3(int a, int b, int c);
 void emit_4(int a, int b, int c, int d);
@@ -44,6 +69,10 @@ void emit_le(uint32_t a);
 void emit_diff(uint32_t a, uint32_t b);
 
 extern int CHUNKED_FUNC_SIZE;
+// Sets the number of pcs per chunk for a backend whose host language
+// prefers a size other than the default, unless -chunked_func_size was
+// given.
+void set_default_chunked_func_size(int size);
 
 int emit_chunked_main_loop(Inst* inst,
                            void (*emit_func_prologue)(int func_id),
@@ -51,9 +80,118 @@ int emit_chunked_main_loop(Inst* inst,
                            void (*emit_pc_change)(int pc),
                            void (*emit_inst)(Inst* inst));
 
-void emit_elf_header(uint16_t machine, uint32_t filesz);
+// Splits every CHUNKED_FUNC_SIZE window of pcs into chunks whose
+// estimated code size stays within |max_size|, counting |inst_size| for
+// each instruction and |pc_size| for each pc. Returns the first pc of each
+// chunk followed by the number of pcs, and sets |num_chunks|.
+int* split_chunks(Inst* text, int (*inst_size)(Inst* inst), int pc_size,
+                  int max_size, int* num_chunks);
+// Same as emit_chunked_main_loop, but with the chunks of split_chunks.
+int emit_split_main_loop(Inst* inst, int* chunk_starts,
+                         void (*emit_func_prologue)(int func_id),
+                         void (*emit_func_epilogue)(void),
+                         void (*emit_pc_change)(int pc),
+                         void (*emit_inst)(Inst* inst));
+
+// HotSpot does not JIT compile methods of more than 8000 bytes of
+// bytecode, so JVM backends keep their chunks well below that, which also
+// keeps them away from the 64KB limit of a method.
+static const int JVM_MAX_METHOD_SIZE = 6000;
+// Each pc costs a tableswitch entry and a goto.
+static const int JVM_PC_SIZE = 7;
+int jvm_inst_size(Inst* inst);
+
+// Returns a table of num_pcs + 1 flags for the pcs which register jumps
+// are likely to land on. Code addresses in EIR come from labels, so these
+// are the pcs which appear as an immediate or a data word. A program may
+// still compute others, so callers need a way to run any pc.
+bool* find_indirect_targets(Module* module, int num_pcs);
+
+// Emits one function per chunk like emit_chunked_main_loop, but with
+// structured control flow for JavaScript: |emit_func_prologue| opens a
+// function, in which code runs in a loop labeled "dispatch" with a switch
+// on pc. Jumps are emitted with structured_jump_str, and leaving the
+// chunk breaks the loop with pc set. EXIT should break it too. The
+// instructions of a pc which is not an entry of its chunk are emitted a
+// second time for register jumps to it, and a pc past the end of the
+// program clears running.
+int emit_structured_main_loop(Module* module,
+                              void (*emit_func_prologue)(int func_id),
+                              void (*emit_func_epilogue)(void),
+                              void (*emit_inst)(Inst* inst));
+// Returns the statement which jumps to the target of |inst|.
+const char* structured_jump_str(Inst* inst);
+
+// Returns the number of words up to the last non-zero data word.
+int data_size(Data* data);
+// Emits the data words up to data_size() as a comma-separated list, which
+// is an array initializer in most C-like languages.
+void emit_data_words(Data* data);
+// Emits the same words as base64 string literals of 16 words each,
+// followed by commas. Every word takes four characters, most significant
+// first.
+void emit_data_base64(Data* data);
+
+// Words of heap and stack on top of the data image. When zero, memory has
+// the whole 1<<24 words of the address space.
+extern int MEM_BUDGET;
+// Returns log2 of the number of memory words. Backends which support
+// MEM_BUDGET allocate 1<<mem_size_bits() words and access them through
+// mem_index_str(), so the stack growing down from address 0 wraps to the
+// end of the smaller memory.
+int mem_size_bits(Data* data);
+const char* mem_index_str(const char* addr, int bits);
+// Script backends which would fill 1<<24 cells at start-up can use a
+// sparse memory (a hash with a default of 0) instead with -sparse_mem 1.
+// It starts fast but slows down every access, so memory is dense by
+// default, with 1<<mem_size_bits() cells, which MEM_BUDGET keeps small.
+extern bool SPARSE_MEM;
+bool use_sparse_mem(void);
+
+int elf_data_addr(uint32_t filesz);
+extern bool ELF_SYMTAB;
+extern const char* ELF_PERF_MAP;
+
+void emit_elf_header(uint16_t machine, uint32_t filesz, Module* module);
+void emit_elf_data(Data* data);
+// Emits .symtab with one symbol per label after the data image when
+// ELF_SYMTAB is set, and writes ELF_PERF_MAP when specified.
+void emit_elf_symbols(Module* module, uint32_t filesz, int* pc2addr);
+
+// WebAssembly binary modules, shared by the wasm and wasi backends.
+// Chunk functions and the main loop have type 0, which must be () -> ().
+// Chunks keep VM registers in locals 0 to 6 (a, b, c, d, bp, sp, pc) and
+// spill them to globals 0 to 6 when control leaves the chunk.
+void emit_uleb128(uint32_t v);
+// Emits i32.const for a VM word, which is less than 1<<24.
+void emit_wasm_i32_const(uint32_t v);
+void emit_wasm_name(const char* name);
+// Emits a fixed-size placeholder for a size, which is patched with the
+// number of bytes emitted after it by emit_wasm_size_end.
+int emit_wasm_size_start();
+void emit_wasm_size_end(int addr);
+int emit_wasm_section_start(int id);
+int wasm_num_chunks(Inst* text);
+void emit_wasm_value(Value* v);
+// Emits |num_globals| mutable i32 globals, which start with the 7 VM
+// registers.
+void emit_wasm_globals(int num_globals);
+void emit_wasm_table(int num_chunks);
+void emit_wasm_elem(int first_chunk, int num_chunks);
+// Starts the code section with one function per chunk followed by the
+// main loop, and returns the address to pass to emit_wasm_size_end after
+// the bodies of |num_extra_funcs| more functions. |emit_io| emits PUTC,
+// GETC and EXIT.
+int emit_wasm_code(Inst* text, void (*emit_io)(Inst* inst),
+                   int num_extra_funcs);
+// Emits an active data segment with the data image at address 0.
+void emit_wasm_data_segment(Data* data);
 
 bool parse_bool_value(const char* value);
 bool handle_chunked_func_size_arg(const char* key, const char* value);
+bool handle_elf_args(const char* key, const char* value);
+bool handle_mem_budget_arg(const char* key, const char* value);
+// Handles sparse_mem and mem_budget.
+bool handle_sparse_mem_args(const char* key, const char* value);
 
 #endif  // ELVM_UTIL_H_
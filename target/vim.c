@@ -5,12 +5,31 @@ static const char* REG_NAMES_VIM[] = {
   "s:a", "s:b", "s:c", "s:d", "s:bp", "s:sp", "s:pc"
 };
 
+// 0 for the sparse memory, which is a dictionary.
+static int vim_mem_bits = 24;
+
+static const char* vim_mem_index(const char* addr) {
+  if (vim_mem_bits == 0 || vim_mem_bits == 24)
+    return addr;
+  return format("and(%s, %d)", addr, (1 << vim_mem_bits) - 1);
+}
+
 static void init_state_vim(Data* data) {
   reg_names = REG_NAMES_VIM;
   for (int i = 0; i < 7; i++) {
     emit_line("let %s = 0", reg_names[i]);
   }
-  emit_line("let s:mem = repeat([0], 16777216)");
+  if (use_sparse_mem()) {
+    vim_mem_bits = 0;
+    emit_line("let s:mem = {}");
+  } else {
+    vim_mem_bits = mem_size_bits(data);
+    if (vim_mem_bits == 24) {
+      emit_line("let s:mem = repeat([0], 16777216)");
+    } else {
+      emit_line("let s:mem = repeat([0], %d)", 1 << vim_mem_bits);
+    }
+  }
   for (int mp = 0; data; data = data->next, mp++) {
     if (data->v) {
       emit_line("let s:mem[%d] = %d", mp, data->v);
@@ -74,11 +93,18 @@ static void vim_emit_inst(Inst* inst) {
     break;
 
   case LOAD:
-    emit_line("let %s = s:mem[%s]", reg_names[inst->dst.reg], src_str(inst));
+    if (vim_mem_bits == 0) {
+      emit_line("let %s = get(s:mem, %s, 0)",
+                reg_names[inst->dst.reg], src_str(inst));
+    } else {
+      emit_line("let %s = s:mem[%s]",
+                reg_names[inst->dst.reg], vim_mem_index(src_str(inst)));
+    }
     break;
 
   case STORE:
-    emit_line("let s:mem[%s] = %s", src_str(inst), reg_names[inst->dst.reg]);
+    emit_line("let s:mem[%s] = %s",
+              vim_mem_index(src_str(inst)), reg_names[inst->dst.reg]);
     break;
 
   case PUTC:
@@ -9,15 +9,80 @@ static const char* WASI_REG_NAMES[] = {
   "$a", "$b", "$c", "$d", "$bp", "$sp", "$pc"
 };
 
+// I/O is buffered in the page after the VM memory, which starts at
+// (1<<26). Output is flushed when its buffer is full, on EXIT, and before
+// reading, and input is read ahead as much as fd_read returns.
+static const int WASI_IOVEC = 0;
+static const int WASI_NBYTES = 8;
+static const int WASI_OUT_BUF = 1024;
+static const int WASI_IN_BUF = 16384;
+static const int WASI_BUF_SIZE = 8192;
+
+static const char* wasi_scratch(int offset) {
+    return format("(i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const %d))",
+                  UINT_MAX_STR, 4 + offset);
+}
+
+static void wasi_emit_io_funcs(void) {
+    emit_line("(global $out_len (mut i32) (i32.const 0))");
+    emit_line("(global $in_pos (mut i32) (i32.const 0))");
+    emit_line("(global $in_len (mut i32) (i32.const 0))");
+
+    emit_line("(func $flush");
+    inc_indent();
+    emit_line("(if (get_global $out_len)");
+    inc_indent();
+    emit_line("(then");
+    inc_indent();
+    emit_line("(i32.store %s %s)", wasi_scratch(WASI_IOVEC), wasi_scratch(WASI_OUT_BUF));
+    emit_line("(i32.store %s (get_global $out_len))", wasi_scratch(WASI_IOVEC + 4));
+    emit_line("(drop (call $__wasi_fd_write (i32.const 1) %s (i32.const 1) %s))",
+              wasi_scratch(WASI_IOVEC), wasi_scratch(WASI_NBYTES));
+    emit_line("(set_global $out_len (i32.const 0))");
+    dec_indent();
+    emit_line(") ;; then");
+    dec_indent();
+    emit_line(") ;; if");
+    dec_indent();
+    emit_line(") ;; func flush");
+
+    emit_line("(func $putc (param $c i32)");
+    inc_indent();
+    emit_line("(i32.store8 (i32.add %s (get_global $out_len)) (get_local $c))",
+              wasi_scratch(WASI_OUT_BUF));
+    emit_line("(set_global $out_len (i32.add (get_global $out_len) (i32.const 1)))");
+    emit_line("(if (i32.eq (get_global $out_len) (i32.const %d)) (then (call $flush)))",
+              WASI_BUF_SIZE);
+    dec_indent();
+    emit_line(") ;; func putc");
+
+    emit_line("(func $getc (result i32)");
+    inc_indent();
+    emit_line("(if (i32.eq (get_global $in_pos) (get_global $in_len))");
+    inc_indent();
+    emit_line("(then");
+    inc_indent();
+    emit_line("(call $flush)");
+    emit_line("(i32.store %s %s)", wasi_scratch(WASI_IOVEC), wasi_scratch(WASI_IN_BUF));
+    emit_line("(i32.store %s (i32.const %d))", wasi_scratch(WASI_IOVEC + 4), WASI_BUF_SIZE);
+    emit_line("(drop (call $__wasi_fd_read (i32.const 0) %s (i32.const 1) %s))",
+              wasi_scratch(WASI_IOVEC), wasi_scratch(WASI_NBYTES));
+    emit_line("(set_global $in_pos (i32.const 0))");
+    emit_line("(set_global $in_len (i32.load %s))", wasi_scratch(WASI_NBYTES));
+    emit_line("(if (i32.eqz (get_global $in_len)) (then (return (i32.const 0))))");
+    dec_indent();
+    emit_line(") ;; then");
+    dec_indent();
+    emit_line(") ;; if");
+    emit_line("(i32.load8_u (i32.add %s (get_global $in_pos)))", wasi_scratch(WASI_IN_BUF));
+    emit_line("(set_global $in_pos (i32.add (get_global $in_pos) (i32.const 1)))");
+    dec_indent();
+    emit_line(") ;; func getc");
+}
+
 static void wasi_init_memory(Data* data) {
     emit_line("(func $init_memory");
     inc_indent();
-    emit_line("(i32.store (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 4)) (i32.const 0)) ;; buffer",
-              UINT_MAX_STR);
-    emit_line("(i32.store (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 8)) (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 4))) ;; buf pointer",
-              UINT_MAX_STR, UINT_MAX_STR);
-    emit_line("(i32.store (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 12)) (i32.const 1)) ;; buf length",
-              UINT_MAX_STR);
     // mem[n]: i32.store (i32.mul (4) (n)) (x)
     for (int mp = 0; data; data = data->next, mp++) {
         if (data->v) {
@@ -28,30 +93,52 @@ static void wasi_init_memory(Data* data) {
     emit_line(") ;; func init_memory");
 }
 
+static int wasi_num_pcs;
+static int wasi_chunk_end;
+
+// Same layout as the wasm backend: VM registers live in locals while a
+// chunk runs, and a br_table over one nested block per pc dispatches.
 static void wasi_emit_func_prologue(int func_id) {
+    int base = func_id * CHUNKED_FUNC_SIZE;
+    int num_cases = wasi_num_pcs - base;
+    if (num_cases > CHUNKED_FUNC_SIZE)
+        num_cases = CHUNKED_FUNC_SIZE;
+    wasi_chunk_end = base + num_cases;
+
     emit_line("");
     emit_line("(func $f%d", func_id);
     inc_indent();
+    for (int i = 0; i < 7; i++) {
+        emit_line("(local %s i32)", reg_names[i]);
+    }
+    for (int i = 0; i < 7; i++) {
+        emit_line("(set_local %s (get_global %s))", reg_names[i], reg_names[i]);
+    }
     emit_line("(loop $loop0");
     inc_indent();
-    // "for %d <= pc && pc < %d {", func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE
-    emit_line("(br_if 1 (i32.or (i32.gt_u (i32.const %d) (get_global $pc)) (i32.ge_u (get_global $pc) (i32.const %d))))",
-              func_id * CHUNKED_FUNC_SIZE, (func_id + 1) * CHUNKED_FUNC_SIZE);
-    emit_line("(if");
+    emit_line("(block $out");
     inc_indent();
-    emit_line("(i32.eqz (i32.const 1))");
-    emit_line("(then");
+    for (int i = num_cases - 1; i >= 0; i--) {
+        emit_line("(block $pc%d", base + i);
+    }
+    emit_line("(br_table");
     inc_indent();
-    emit_line("(nop)");
+    for (int i = 0; i < num_cases; i++) {
+        emit_line("$pc%d", base + i);
+    }
+    emit_line("$out");
+    emit_line("(i32.sub (get_local $pc) (i32.const %d))", base);
+    dec_indent();
+    emit_line(") ;; br_table");
 }
 
 static void wasi_emit_func_epilogue(void) {
+    emit_line("(set_local $pc (i32.const %d))", wasi_chunk_end);
     dec_indent();
-    emit_line(") ;; then");
-    dec_indent();
-    emit_line(") ;; if");
-    emit_line("(set_global $pc (i32.add (get_global $pc) (i32.const 1)))");
-    emit_line("(br $loop0)");
+    emit_line(") ;; block $out");
+    for (int i = 0; i < 7; i++) {
+        emit_line("(set_global %s (get_local %s))", reg_names[i], reg_names[i]);
+    }
     dec_indent();
     emit_line(") ;; loop $loop0");
     dec_indent();
@@ -59,21 +146,13 @@ static void wasi_emit_func_epilogue(void) {
 }
 
 static void wasi_emit_pc_change(int pc) {
-    dec_indent();
-    emit_line(") ;; then");
-    dec_indent();
-    emit_line(") ;; if");
-    emit_line("(if");
-    inc_indent();
-    emit_line("(i32.eq (get_global $pc) (i32.const %d))", pc);
-    emit_line("(then");
-    inc_indent();
+    emit_line(") ;; block $pc%d", pc);
 }
 
 // wasm_get_value
 static const char* wasi_get_value(Value *v) {
   if (v->type == REG) {
-    return format("(get_global %s)", reg_names[v->reg]);
+    return format("(get_local %s)", reg_names[v->reg]);
   } else if (v->type == IMM) {
     return format("(i32.const %d)", v->imm);
   } else {
@@ -107,54 +186,45 @@ const char* wasi_cmp_str(Inst* inst) {
     default:
       error("oops");
   }
-  return format("(%s (get_global %s) %s)", op_str, reg_names[inst->dst.reg], wasi_get_value(&inst->src));
+  return format("(%s (get_local %s) %s)", op_str, reg_names[inst->dst.reg], wasi_get_value(&inst->src));
 }
 
 static void wasi_emit_inst(Inst* inst) {
     switch (inst->op) {
     case MOV:
-        emit_line("(set_global %s %s)", reg_names[inst->dst.reg], wasi_get_value(&inst->src));
+        emit_line("(set_local %s %s)", reg_names[inst->dst.reg], wasi_get_value(&inst->src));
         break;
 
     case ADD:
-        emit_line("(set_global %s (i32.and (i32.add (get_global %s) %s) (i32.const " UINT_MAX_STR ")))",
+        emit_line("(set_local %s (i32.and (i32.add (get_local %s) %s) (i32.const " UINT_MAX_STR ")))",
                   reg_names[inst->dst.reg], reg_names[inst->dst.reg], wasi_get_value(&inst->src));
         break;
 
     case SUB:
-        emit_line("(set_global %s (i32.and (i32.sub (get_global %s) %s) (i32.const " UINT_MAX_STR ")))",
+        emit_line("(set_local %s (i32.and (i32.sub (get_local %s) %s) (i32.const " UINT_MAX_STR ")))",
                   reg_names[inst->dst.reg], reg_names[inst->dst.reg], wasi_get_value(&inst->src));
         break;
 
     case LOAD:
-        emit_line("(set_global %s (i32.load (i32.mul (i32.const 4) %s)))",
+        emit_line("(set_local %s (i32.load (i32.mul (i32.const 4) %s)))",
                   reg_names[inst->dst.reg], wasi_get_value(&inst->src));
         break;
 
     case STORE:
-        emit_line("(i32.store (i32.mul (i32.const 4) %s) (get_global %s))",
+        emit_line("(i32.store (i32.mul (i32.const 4) %s) (get_local %s))",
                   wasi_get_value(&inst->src), reg_names[inst->dst.reg]);
         break;
 
     case PUTC:
-        emit_line("(i32.store (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 4)) %s)",
-                  UINT_MAX_STR, wasi_get_value(&inst->src));
-        emit_line("(drop (call $__wasi_fd_write (i32.const 1) (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 8)) (i32.const 1) (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 16))))",
-                  UINT_MAX_STR, UINT_MAX_STR);
-        emit_line("(i32.store (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 4)) (i32.const 0))",
-                  UINT_MAX_STR);
+        emit_line("(call $putc %s)", wasi_get_value(&inst->src));
         break;
 
     case GETC:
-        emit_line("(i32.store (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 4)) (i32.const 0))",
-                  UINT_MAX_STR);
-        emit_line("(drop (call $__wasi_fd_read (i32.const 0) (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 8)) (i32.const 1) (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 16))))",
-                  UINT_MAX_STR, UINT_MAX_STR);
-        emit_line("(set_global %s (i32.load (i32.add (i32.mul (i32.const 4) (i32.const %s)) (i32.const 4))))",
-                  reg_names[inst->dst.reg], UINT_MAX_STR);
+        emit_line("(set_local %s (call $getc))", reg_names[inst->dst.reg]);
         break;
 
     case EXIT:
+        emit_line("(call $flush)");
         emit_line("(call $__wasi_proc_exit (i32.const 0))");
         break;
 
@@ -173,12 +243,12 @@ static void wasi_emit_inst(Inst* inst) {
         emit_line("%s", wasi_cmp_str(inst));
         emit_line("(then");
         inc_indent();
-        emit_line("(set_global %s (i32.const 1))", reg_names[inst->dst.reg]);
+        emit_line("(set_local %s (i32.const 1))", reg_names[inst->dst.reg]);
         dec_indent();
         emit_line(") ;; then");
         emit_line("(else");
         inc_indent();
-        emit_line("(set_global %s (i32.const 0))", reg_names[inst->dst.reg]);
+        emit_line("(set_local %s (i32.const 0))", reg_names[inst->dst.reg]);
         dec_indent();
         emit_line(") ;; else");
         dec_indent();
@@ -197,7 +267,7 @@ static void wasi_emit_inst(Inst* inst) {
         emit_line("%s", wasi_cmp_str(inst));
         emit_line("(then");
         inc_indent();
-        emit_line("(set_global $pc %s)", wasi_get_value(&inst->jmp));
+        emit_line("(set_local $pc %s)", wasi_get_value(&inst->jmp));
         emit_line("(br $loop0)");
         dec_indent();
         emit_line(") ;; then");
@@ -223,8 +293,13 @@ void target_wasi(Module* module) {
         emit_line("(global %s (mut i32) (i32.const 0))", reg_names[i]);
     }
 
+    wasi_emit_io_funcs();
     wasi_init_memory(module->data);
 
+    for (Inst* inst = module->text; inst; inst = inst->next) {
+        wasi_num_pcs = inst->pc + 1;
+    }
+
     int num_funcs = emit_chunked_main_loop(module->text, wasi_emit_func_prologue, wasi_emit_func_epilogue, wasi_emit_pc_change, wasi_emit_inst);
 
     emit_line("");
@@ -255,3 +330,196 @@ void target_wasi(Module* module) {
     dec_indent();
     emit_line(") ;; module");
 }
+
+// i32.const (1<<26) + |offset|, an address in the I/O page. elc cannot
+// compute it in 24-bit arithmetic when it runs on ELVM, so the LEB128 is
+// spelled out.
+static void wasi_bin_emit_scratch(int offset) {
+    emit_1(0x41);
+    emit_4(offset % 128 + 128, offset / 128 % 128 + 128,
+           offset / 16384 % 128 + 128, 0x20);
+}
+
+// Function indices of $flush, $putc and $getc, after the chunks and main.
+static int wasi_bin_flush;
+
+static void wasi_bin_emit_io(Inst* inst) {
+    switch (inst->op) {
+    case PUTC:
+        emit_wasm_value(&inst->src);
+        emit_1(0x10);
+        emit_uleb128(wasi_bin_flush + 1);
+        break;
+
+    case GETC:
+        emit_1(0x10);
+        emit_uleb128(wasi_bin_flush + 2);
+        emit_2(0x21, inst->dst.reg);
+        break;
+
+    case EXIT:
+        emit_1(0x10);
+        emit_uleb128(wasi_bin_flush);
+        emit_wasm_i32_const(0);
+        emit_2(0x10, 2);
+        break;
+
+    default:
+        error("oops");
+    }
+}
+
+// The same functions as wasi_emit_io_funcs. Globals 7, 8 and 9 are
+// $out_len, $in_pos and $in_len.
+static void wasi_bin_emit_io_funcs(void) {
+    int addr = emit_wasm_size_start();
+    emit_1(0);
+    // if out_len
+    emit_4(0x23, 7, 0x04, 0x40);
+    wasi_bin_emit_scratch(WASI_IOVEC);
+    wasi_bin_emit_scratch(WASI_OUT_BUF);
+    emit_3(0x36, 2, 0);
+    wasi_bin_emit_scratch(WASI_IOVEC + 4);
+    emit_2(0x23, 7);
+    emit_3(0x36, 2, 0);
+    // drop (fd_write 1 iovec 1 nwritten)
+    emit_wasm_i32_const(1);
+    wasi_bin_emit_scratch(WASI_IOVEC);
+    emit_wasm_i32_const(1);
+    wasi_bin_emit_scratch(WASI_NBYTES);
+    emit_3(0x10, 0, 0x1a);
+    emit_wasm_i32_const(0);
+    emit_2(0x24, 7);
+    emit_2(0x0b, 0x0b);
+    emit_wasm_size_end(addr);
+
+    addr = emit_wasm_size_start();
+    emit_1(0);
+    // out_buf[out_len] = c
+    wasi_bin_emit_scratch(WASI_OUT_BUF);
+    emit_3(0x23, 7, 0x6a);
+    emit_2(0x20, 0);
+    emit_3(0x3a, 0, 0);
+    emit_2(0x23, 7);
+    emit_wasm_i32_const(1);
+    emit_3(0x6a, 0x24, 7);
+    // if out_len == WASI_BUF_SIZE: flush
+    emit_2(0x23, 7);
+    emit_wasm_i32_const(WASI_BUF_SIZE);
+    emit_3(0x46, 0x04, 0x40);
+    emit_1(0x10);
+    emit_uleb128(wasi_bin_flush);
+    emit_2(0x0b, 0x0b);
+    emit_wasm_size_end(addr);
+
+    addr = emit_wasm_size_start();
+    emit_1(0);
+    // if in_pos == in_len
+    emit_4(0x23, 8, 0x23, 9);
+    emit_3(0x46, 0x04, 0x40);
+    emit_1(0x10);
+    emit_uleb128(wasi_bin_flush);
+    wasi_bin_emit_scratch(WASI_IOVEC);
+    wasi_bin_emit_scratch(WASI_IN_BUF);
+    emit_3(0x36, 2, 0);
+    wasi_bin_emit_scratch(WASI_IOVEC + 4);
+    emit_wasm_i32_const(WASI_BUF_SIZE);
+    emit_3(0x36, 2, 0);
+    // drop (fd_read 0 iovec 1 nread)
+    emit_wasm_i32_const(0);
+    wasi_bin_emit_scratch(WASI_IOVEC);
+    emit_wasm_i32_const(1);
+    wasi_bin_emit_scratch(WASI_NBYTES);
+    emit_3(0x10, 1, 0x1a);
+    emit_wasm_i32_const(0);
+    emit_2(0x24, 8);
+    wasi_bin_emit_scratch(WASI_NBYTES);
+    emit_3(0x28, 2, 0);
+    emit_2(0x24, 9);
+    // if in_len == 0: return 0
+    emit_3(0x23, 9, 0x45);
+    emit_2(0x04, 0x40);
+    emit_wasm_i32_const(0);
+    emit_2(0x0f, 0x0b);
+    emit_1(0x0b);
+    // in_buf[in_pos++]
+    wasi_bin_emit_scratch(WASI_IN_BUF);
+    emit_3(0x23, 8, 0x6a);
+    emit_3(0x2d, 0, 0);
+    emit_2(0x23, 8);
+    emit_wasm_i32_const(1);
+    emit_3(0x6a, 0x24, 8);
+    emit_1(0x0b);
+    emit_wasm_size_end(addr);
+}
+
+static void wasi_bin_emit_import(const char* name, int type) {
+    emit_wasm_name("wasi_unstable");
+    emit_wasm_name(name);
+    emit_2(0, type);
+}
+
+// Emits the same program as target_wasi as a binary module, so no
+// assembler is needed to run it.
+void target_wasi_bin(Module* module) {
+    int num_chunks = wasm_num_chunks(module->text);
+    emit_buffer_start();
+    emit_4(0, 'a', 's', 'm');
+    emit_4(1, 0, 0, 0);
+
+    int addr = emit_wasm_section_start(1);
+    emit_1(4);
+    // () -> (), (i32) -> (), (i32 i32 i32 i32) -> i32, () -> i32
+    emit_3(0x60, 0, 0);
+    emit_4(0x60, 1, 0x7f, 0);
+    emit_4(0x60, 4, 0x7f, 0x7f);
+    emit_4(0x7f, 0x7f, 1, 0x7f);
+    emit_4(0x60, 0, 1, 0x7f);
+    emit_wasm_size_end(addr);
+
+    addr = emit_wasm_section_start(2);
+    emit_1(3);
+    wasi_bin_emit_import("fd_write", 2);
+    wasi_bin_emit_import("fd_read", 2);
+    wasi_bin_emit_import("proc_exit", 1);
+    emit_wasm_size_end(addr);
+
+    wasi_bin_flush = 4 + num_chunks;
+    addr = emit_wasm_section_start(3);
+    emit_uleb128(num_chunks + 4);
+    for (int i = 0; i <= num_chunks; i++)
+        emit_1(0);
+    emit_3(0, 1, 3);
+    emit_wasm_size_end(addr);
+
+    emit_wasm_table(num_chunks);
+
+    addr = emit_wasm_section_start(5);
+    emit_1(1);
+    emit_1(0);
+    emit_uleb128(WASI_MEM_SIZE_IN_PAGES);
+    emit_wasm_size_end(addr);
+
+    emit_wasm_globals(10);
+
+    addr = emit_wasm_section_start(7);
+    emit_1(2);
+    emit_wasm_name("memory");
+    emit_2(2, 0);
+    emit_wasm_name("_start");
+    emit_1(0);
+    emit_uleb128(3 + num_chunks);
+    emit_wasm_size_end(addr);
+
+    emit_wasm_elem(3, num_chunks);
+    addr = emit_wasm_code(module->text, wasi_bin_emit_io, 3);
+    wasi_bin_emit_io_funcs();
+    emit_wasm_size_end(addr);
+
+    addr = emit_wasm_section_start(11);
+    emit_1(1);
+    emit_wasm_data_segment(module->data);
+    emit_wasm_size_end(addr);
+
+    emit_buffer_flush();
+}
@@ -16,43 +16,54 @@ static void wasm_init_state(void) {
   emit_line("(memory %d)", WASM_MEM_SIZE_IN_PAGES);
 }
 
+static int wasm_num_pcs;
+static int wasm_chunk_end;
+
+// Each chunk keeps VM registers in locals, which are loaded on entry and
+// spilled back to the globals when control leaves the chunk. Dispatch is
+// a br_table over one nested block per pc: the code of a pc follows the
+// end of its block, so falling through to the next pc needs no dispatch.
 static void wasm_emit_func_prologue(int func_id) {
+  int base = func_id * CHUNKED_FUNC_SIZE;
+  int num_cases = wasm_num_pcs - base;
+  if (num_cases > CHUNKED_FUNC_SIZE)
+    num_cases = CHUNKED_FUNC_SIZE;
+  wasm_chunk_end = base + num_cases;
+
   emit_line("");
   emit_line("(func $func%d", func_id);
   inc_indent();
+  for (int i = 0; i < 7; i++) {
+    emit_line("(local $%s i32)", reg_names[i]);
+  }
+  for (int i = 0; i < 7; i++) {
+    emit_line("(set_local $%s (get_global $%s))", reg_names[i], reg_names[i]);
+  }
   emit_line("(loop $while0");
   inc_indent();
-  emit_line("(if (i32.and (i32.le_s (i32.const %d) (get_global $pc))",
-            func_id * CHUNKED_FUNC_SIZE);
-  emit_line("             (i32.lt_s (get_global $pc) (i32.const %d)))",
-            (func_id + 1) * CHUNKED_FUNC_SIZE);
-  inc_indent();
-  emit_line("(then");
+  emit_line("(block $out");
   inc_indent();
-  emit_line("(block $while0body");
-  inc_indent();
-  // dummy first case
-  emit_line("(if (i32.eq (get_global $pc) (i32.const -1))");
-  inc_indent();
-  emit_line("(then");
+  for (int i = num_cases - 1; i >= 0; i--) {
+    emit_line("(block $pc%d", base + i);
+  }
+  emit_line("(br_table");
   inc_indent();
+  for (int i = 0; i < num_cases; i++) {
+    emit_line("$pc%d", base + i);
+  }
+  emit_line("$out");
+  emit_line("(i32.sub (get_local $pc) (i32.const %d))", base);
+  dec_indent();
+  emit_line(")"); // br_table
 }
 
 static void wasm_emit_func_epilogue(void) {
-  emit_line("(br $while0body)");
-  dec_indent();
-  emit_line(")"); // then
-  dec_indent();
-  emit_line(")"); // if
-  emit_line("");
-  dec_indent();
-  emit_line(")"); // block $while0body
-  emit_line("(set_global $pc (i32.add (get_global $pc) (i32.const 1)))");
-  emit_line("(br $while0)");
+  emit_line("(set_local $pc (i32.const %d))", wasm_chunk_end);
   dec_indent();
-  emit_line(")"); // then
-  dec_indent();
-  emit_line(")"); // if
+  emit_line(")"); // block $out
+  for (int i = 0; i < 7; i++) {
+    emit_line("(set_global $%s (get_local $%s))", reg_names[i], reg_names[i]);
+  }
   dec_indent();
   emit_line(")"); // loop $while0
   dec_indent();
@@ -60,21 +71,12 @@ static void wasm_emit_func_epilogue(void) {
 }
 
 static void wasm_emit_pc_change(int pc) {
-  emit_line("(br $while0body)");
-  dec_indent();
-  emit_line(")"); // then
-  dec_indent();
-  emit_line(")"); // if
-  emit_line("");
-  emit_line("(if (i32.eq (get_global $pc) (i32.const %d))", pc);
-  inc_indent();
-  emit_line("(then");
-  inc_indent();
+  emit_line(") ;; pc %d", pc);
 }
 
 static const char* wasm_get_value(Value *v) {
   if (v->type == REG) {
-    return format("(get_global $%s)", reg_names[v->reg]);
+    return format("(get_local $%s)", reg_names[v->reg]);
   } else if (v->type == IMM) {
     return format("(i32.const %d)", v->imm);
   } else {
@@ -101,33 +103,33 @@ static const char* wasm_cmp_expr(Inst* inst) {
     default:
       error("oops");
   }
-  return format("(%s (get_global $%s) %s)",
+  return format("(%s (get_local $%s) %s)",
                 op_str, reg_names[inst->dst.reg], wasm_get_value(&inst->src));
 }
 
 static void wasm_emit_inst(Inst* inst) {
   switch (inst->op) {
   case MOV:
-    emit_line("(set_global $%s %s)", reg_names[inst->dst.reg], wasm_get_value(&inst->src));
+    emit_line("(set_local $%s %s)", reg_names[inst->dst.reg], wasm_get_value(&inst->src));
     break;
 
   case ADD:
-    emit_line("(set_global $%s (i32.and (i32.add (get_global $%s) %s) (i32.const " UINT_MAX_STR ")))",
+    emit_line("(set_local $%s (i32.and (i32.add (get_local $%s) %s) (i32.const " UINT_MAX_STR ")))",
               reg_names[inst->dst.reg], reg_names[inst->dst.reg], wasm_get_value(&inst->src));
     break;
 
   case SUB:
-    emit_line("(set_global $%s (i32.and (i32.sub (get_global $%s) %s) (i32.const " UINT_MAX_STR ")))",
+    emit_line("(set_local $%s (i32.and (i32.sub (get_local $%s) %s) (i32.const " UINT_MAX_STR ")))",
               reg_names[inst->dst.reg], reg_names[inst->dst.reg], wasm_get_value(&inst->src));
     break;
 
   case LOAD:
-    emit_line("(set_global $%s (i32.load (i32.shl %s (i32.const 2))))",
+    emit_line("(set_local $%s (i32.load (i32.shl %s (i32.const 2))))",
               reg_names[inst->dst.reg], wasm_get_value(&inst->src));
     break;
 
   case STORE:
-    emit_line("(i32.store (i32.shl %s (i32.const 2)) (get_global $%s))",
+    emit_line("(i32.store (i32.shl %s (i32.const 2)) (get_local $%s))",
               wasm_get_value(&inst->src), reg_names[inst->dst.reg]);
     break;
 
@@ -136,7 +138,7 @@ static void wasm_emit_inst(Inst* inst) {
     break;
 
   case GETC:
-    emit_line("(set_global $%s (call $getchar))", reg_names[inst->dst.reg]);
+    emit_line("(set_local $%s (call $getchar))", reg_names[inst->dst.reg]);
     break;
 
   case EXIT:
@@ -152,7 +154,7 @@ static void wasm_emit_inst(Inst* inst) {
   case GT:
   case LE:
   case GE:
-    emit_line("(set_global $%s %s)", reg_names[inst->dst.reg], wasm_cmp_expr(inst));
+    emit_line("(set_local $%s %s)", reg_names[inst->dst.reg], wasm_cmp_expr(inst));
     break;
 
   case JEQ:
@@ -161,12 +163,12 @@ static void wasm_emit_inst(Inst* inst) {
   case JGT:
   case JLE:
   case JGE:
-    emit_line("(if %s (then (set_global $pc %s) (br $while0)))",
+    emit_line("(if %s (then (set_local $pc %s) (br $while0)))",
               wasm_cmp_expr(inst), wasm_get_value(&inst->jmp));
     break;
 
   case JMP:
-    emit_line("(set_global $pc %s)", wasm_get_value(&inst->jmp));
+    emit_line("(set_local $pc %s)", wasm_get_value(&inst->jmp));
     emit_line("(br $while0)");
     break;
 
@@ -178,6 +180,10 @@ static void wasm_emit_inst(Inst* inst) {
 void target_wasm(Module* module) {
   wasm_init_state();
 
+  for (Inst* inst = module->text; inst; inst = inst->next) {
+    wasm_num_pcs = inst->pc + 1;
+  }
+
   int num_funcs = emit_chunked_main_loop(module->text,
                                          wasm_emit_func_prologue,
                                          wasm_emit_func_epilogue,
@@ -222,3 +228,88 @@ void target_wasm(Module* module) {
   dec_indent();
   emit_line(")"); // module
 }
+
+static void wasm_bin_emit_io(Inst* inst) {
+  switch (inst->op) {
+  case PUTC:
+    emit_wasm_value(&inst->src);
+    emit_2(0x10, 1);
+    break;
+
+  case GETC:
+    emit_2(0x10, 0);
+    emit_2(0x21, inst->dst.reg);
+    break;
+
+  case EXIT:
+    emit_2(0x10, 2);
+    break;
+
+  default:
+    error("oops");
+  }
+}
+
+static void wasm_bin_emit_import(const char* name, int type) {
+  emit_wasm_name("env");
+  emit_wasm_name(name);
+  emit_2(0, type);
+}
+
+// Emits the same program as target_wasm as a binary module, so no
+// assembler is needed to run it.
+void target_wasm_bin(Module* module) {
+  int num_chunks = wasm_num_chunks(module->text);
+  emit_buffer_start();
+  emit_4(0, 'a', 's', 'm');
+  emit_4(1, 0, 0, 0);
+
+  int addr = emit_wasm_section_start(1);
+  emit_1(3);
+  // () -> (), () -> i32, (i32) -> ()
+  emit_3(0x60, 0, 0);
+  emit_4(0x60, 0, 1, 0x7f);
+  emit_4(0x60, 1, 0x7f, 0);
+  emit_wasm_size_end(addr);
+
+  addr = emit_wasm_section_start(2);
+  emit_1(3);
+  wasm_bin_emit_import("getchar", 1);
+  wasm_bin_emit_import("putchar", 2);
+  wasm_bin_emit_import("exit", 0);
+  emit_wasm_size_end(addr);
+
+  addr = emit_wasm_section_start(3);
+  emit_uleb128(num_chunks + 1);
+  for (int i = 0; i <= num_chunks; i++)
+    emit_1(0);
+  emit_wasm_size_end(addr);
+
+  emit_wasm_table(num_chunks);
+
+  addr = emit_wasm_section_start(5);
+  emit_1(1);
+  emit_1(0);
+  emit_uleb128(WASM_MEM_SIZE_IN_PAGES);
+  emit_wasm_size_end(addr);
+
+  emit_wasm_globals(7);
+
+  addr = emit_wasm_section_start(7);
+  emit_1(1);
+  emit_wasm_name("wasmmain");
+  emit_1(0);
+  emit_uleb128(3 + num_chunks);
+  emit_wasm_size_end(addr);
+
+  emit_wasm_elem(3, num_chunks);
+  addr = emit_wasm_code(module->text, wasm_bin_emit_io, 0);
+  emit_wasm_size_end(addr);
+
+  addr = emit_wasm_section_start(11);
+  emit_1(1);
+  emit_wasm_data_segment(module->data);
+  emit_wasm_size_end(addr);
+
+  emit_buffer_flush();
+}
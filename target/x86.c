@@ -68,7 +68,9 @@ static void emit_setcc(Inst* inst, int op) {
   emit_3(0x0f, op, 0xc0 + REGNO[inst->dst.reg]);
 }
 
-static void emit_jcc(Inst* inst, int op, int* pc2addr, int rodata_addr) {
+static Reloc* g_relocs;
+
+static void emit_jcc(Inst* inst, int op, int* pc2addr) {
   if (op) {
     emit_cmp_x86(inst);
     emit_2(op, inst->jmp.type == REG ? 7 : 5);
@@ -76,35 +78,23 @@ static void emit_jcc(Inst* inst, int op, int* pc2addr, int rodata_addr) {
 
   if (inst->jmp.type == REG) {
     emit_3(0xff, 0x24, 0x85 + (REGNO[inst->jmp.reg] * 8));
-    emit_le(rodata_addr);
+    g_relocs = add_reloc(g_relocs, emit_cnt(), RELOC_RODATA);
+    emit_le(0);
   } else {
     emit_1(0xe9);
-    emit_diff(pc2addr[inst->jmp.imm], emit_cnt() + 4);
+    if (inst->jmp.imm <= inst->pc) {
+      emit_diff(pc2addr[inst->jmp.imm], emit_cnt() + 4);
+    } else {
+      g_relocs = add_reloc(g_relocs, emit_cnt(), inst->jmp.imm);
+      emit_le(0);
+    }
   }
 }
 
-static void init_state_x86(Data* data) {
-  emit_mov_imm(B, 0);
-  // mov ECX, 1<<26
-  emit_5(0xb8 + REGNO[C], 0, 0, 0, 4);
-  emit_mov_imm(D, 3);  // PROT_READ | PROT_WRITE
-  emit_mov_imm(ESI, 0x22);  // MAP_PRIVATE | MAP_ANONYMOUS
-  // mov EDI, 0xffffffff
-  emit_5(0xb8 + REGNO[EDI], 0xff, 0xff, 0xff, 0xff);
-  emit_mov_imm(BP, 0);
-  emit_mov_imm(A, 192);  // mmap2
-  emit_int80();
-
-  emit_mov_reg(ESI, A);
-
-  for (int mp = 0; data; data = data->next, mp++) {
-    if (data->v) {
-      // mov dword [EAX+mp*4], data->v
-      emit_2(0xc7, 0x80);
-      emit_le(mp * 4);
-      emit_le(data->v);
-    }
-  }
+static void init_state_x86() {
+  emit_1(0xb8 + REGNO[ESI]);
+  g_relocs = add_reloc(g_relocs, emit_cnt(), RELOC_DATA);
+  emit_le(0);
 
   // mov ESP, 1<<24
   emit_5(0xb8 + REGNO[SP], 0, 0, 0, 1);
@@ -115,7 +105,7 @@ static void init_state_x86(Data* data) {
   emit_zero_reg(BP);
 }
 
-static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
+static void x86_emit_inst(Inst* inst, int* pc2addr) {
   switch (inst->op) {
     case MOV:
       emit_mov(inst->dst.reg, &inst->src);
@@ -240,31 +230,31 @@ static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
       break;
 
     case JEQ:
-      emit_jcc(inst, 0x75, pc2addr, rodata_addr);
+      emit_jcc(inst, 0x75, pc2addr);
       break;
 
     case JNE:
-      emit_jcc(inst, 0x74, pc2addr, rodata_addr);
+      emit_jcc(inst, 0x74, pc2addr);
       break;
 
     case JLT:
-      emit_jcc(inst, 0x7d, pc2addr, rodata_addr);
+      emit_jcc(inst, 0x7d, pc2addr);
       break;
 
     case JGT:
-      emit_jcc(inst, 0x7e, pc2addr, rodata_addr);
+      emit_jcc(inst, 0x7e, pc2addr);
       break;
 
     case JLE:
-      emit_jcc(inst, 0x7f, pc2addr, rodata_addr);
+      emit_jcc(inst, 0x7f, pc2addr);
       break;
 
     case JGE:
-      emit_jcc(inst, 0x7c, pc2addr, rodata_addr);
+      emit_jcc(inst, 0x7c, pc2addr);
       break;
 
     case JMP:
-      emit_jcc(inst, 0, pc2addr, rodata_addr);
+      emit_jcc(inst, 0, pc2addr);
       break;
 
     default:
@@ -273,14 +263,14 @@ static void x86_emit_inst(Inst* inst, int* pc2addr, int rodata_addr) {
 }
 
 void target_x86(Module* module) {
-  emit_reset();
-  init_state_x86(module->data);
-
   int pc_cnt = 0;
   for (Inst* inst = module->text; inst; inst = inst->next) {
     pc_cnt++;
   }
 
+  emit_buffer_start();
+  init_state_x86();
+
   int* pc2addr = calloc(pc_cnt, sizeof(int));
   int prev_pc = -1;
   for (Inst* inst = module->text; inst; inst = inst->next) {
@@ -288,22 +278,32 @@ void target_x86(Module* module) {
       pc2addr[inst->pc] = emit_cnt();
     }
     prev_pc = inst->pc;
-    x86_emit_inst(inst, pc2addr, 0);
+    x86_emit_inst(inst, pc2addr);
   }
 
-  int rodata_addr = ELF_TEXT_START + emit_cnt() + ELF_HEADER_SIZE;
-
-  emit_elf_header(3, emit_cnt() + pc_cnt * 4);
-
-  emit_reset();
-  emit_start();
-  init_state_x86(module->data);
-
-  for (Inst* inst = module->text; inst; inst = inst->next) {
-    x86_emit_inst(inst, pc2addr, rodata_addr);
+  // Keep the jump table and the data segment aligned.
+  while (emit_cnt() % 4) {
+    emit_1(0);
   }
 
+  int rodata_addr = ELF_TEXT_START + emit_cnt() + ELF_HEADER_SIZE;
   for (int i = 0; i < pc_cnt; i++) {
     emit_le(ELF_TEXT_START + pc2addr[i] + ELF_HEADER_SIZE);
   }
+  int filesz = emit_cnt();
+
+  for (Reloc* r = g_relocs; r; r = r->next) {
+    if (r->pc == RELOC_RODATA) {
+      emit_patch_le(r->addr, rodata_addr);
+    } else if (r->pc == RELOC_DATA) {
+      emit_patch_le(r->addr, elf_data_addr(filesz));
+    } else {
+      emit_patch_diff(r->addr, pc2addr[r->pc], r->addr + 4);
+    }
+  }
+
+  emit_elf_header(3, filesz, module);
+  emit_elf_data(module->data);
+  emit_elf_symbols(module, filesz, pc2addr);
+  emit_buffer_flush();
 }
@@ -0,0 +1,7 @@
+# A single pc with more PUTCs than the cpp target's default output buffer.
+puts 'main:'
+10001.times{
+  puts 'putc 65'
+}
+puts 'putc 10'
+puts 'exit'
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Usage: tools/autotune.sh TARGET RUNNER [EIR [INPUT]]
+#
+# Compiles EIR (by default the output of tools/autotune_bench.rb) with
+# several -chunked_func_size values, runs each result with RUNNER, and
+# records the fastest size for TARGET in tools/chunked_func_size.txt,
+# along with the time of every size. The time includes whatever RUNNER
+# does to build the program, as that also depends on the chunk size.
+#
+#   tools/autotune.sh py python3
+#   tools/autotune.sh rs tools/runrs.sh
+#
+# SIZES overrides the sizes to try and CONF the file to update.
+
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 TARGET RUNNER [EIR [INPUT]]" >&2
+  exit 1
+fi
+
+target=$1
+runner=$2
+eir=$3
+input=${4:-/dev/null}
+sizes=${SIZES:-64 128 256 512 1024 2048}
+conf=${CONF:-tools/chunked_func_size.txt}
+
+# Runners expect a path relative to the top directory.
+dir=out/autotune.$target
+rm -fr $dir
+mkdir -p $dir
+if [ -z "$eir" ]; then
+  eir=$dir/bench.eir
+  ruby tools/autotune_bench.rb > $eir
+fi
+
+out/eli $eir < $input > $dir/expected
+
+best=
+best_ms=
+report=
+for size in $sizes; do
+  prog=$dir/bench.$size.$target
+  out/elc -$target -chunked_func_size $size $eir > $prog
+  start=$(date +%s%N)
+  $runner $prog < $input > $dir/actual
+  end=$(date +%s%N)
+  if ! cmp -s $dir/expected $dir/actual; then
+    echo "$target: wrong output with chunked_func_size $size" >&2
+    exit 1
+  fi
+  ms=$(( (end - start) / 1000000 ))
+  echo "$target $size ${ms}ms"
+  report="$report $size:${ms}ms"
+  if [ -z "$best" ] || [ $ms -lt $best_ms ]; then
+    best=$size
+    best_ms=$ms
+  fi
+done
+
+touch $conf
+grep -v "^$target " $conf > $dir/conf || true
+echo "$target $best #$report" >> $dir/conf
+sort $dir/conf > $conf
+rm -fr $dir
+echo "$target: best chunked_func_size is $best"
@@ -0,0 +1,41 @@
+# Generates the EIR program tools/autotune.sh times by default: a loop
+# which calls many small functions spread over the whole text, so most
+# calls cross chunk boundaries.
+
+num_funcs = (ARGV[0] || 1500).to_i
+num_rounds = (ARGV[1] || 100).to_i
+
+puts '.data'
+puts 'sum:'
+puts '.long 0'
+puts '.text'
+puts 'main:'
+puts 'mov C, 0'
+puts 'loop:'
+num_funcs.times do |i|
+  puts "mov A, .Lret#{i}"
+  puts "jmp f#{(i * 7919) % num_funcs}"
+  puts ".Lret#{i}:"
+end
+puts 'add C, 1'
+puts "jlt loop, C, #{num_rounds}"
+
+sum = num_rounds * (0...num_funcs).sum % (1 << 24)
+puts 'load B, sum'
+puts "jeq ok, B, #{sum}"
+puts 'putc 78'
+puts 'putc 10'
+puts 'exit'
+puts 'ok:'
+puts 'putc 89'
+puts 'putc 10'
+puts 'exit'
+
+num_funcs.times do |i|
+  puts "f#{i}:"
+  puts 'mov BP, A'
+  puts 'load B, sum'
+  puts "add B, #{i}"
+  puts 'store B, sum'
+  puts 'jmp BP'
+end
@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# Usage: tools/bench_hs_strict.sh EIR [INPUT]
+#
+# Compiles EIR with the hs and hs_strict targets, builds both with
+# ghc -O2 and runs them with +RTS -s, so their time, allocation and GC
+# statistics can be compared. Both outputs are checked against eli.
+#
+# hs_strict is not in the make test matrix yet; run this on test/*.eir on
+# a host with GHC before adding it there.
+
+set -e
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 EIR [INPUT]" >&2
+  exit 1
+fi
+
+eir=$1
+input=${2:-/dev/null}
+dir=out/bench_hs_strict
+rm -fr $dir
+mkdir -p $dir
+
+out/eli $eir < $input > $dir/expected
+for target in hs hs_strict; do
+  out/elc -$target $eir > $dir/$target.hs
+  ghc -O2 -rtsopts -outputdir $dir/$target.o $dir/$target.hs \
+    -o $dir/$target > /dev/null
+  echo "=== $target"
+  $dir/$target +RTS -s -RTS < $input > $dir/$target.out
+  if ! cmp -s $dir/expected $dir/$target.out; then
+    echo "$target: wrong output" >&2
+    exit 1
+  fi
+done
@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# Checks that every symbol in the ELF symbol table of $1, as emitted by
+# -symtab 1, lies inside its .text section.
+
+set -e
+
+text=$(readelf -SW $1 | grep ' \.text ')
+start=$(printf '%d' 0x$(echo "$text" | sed 's/.*PROGBITS *//' | cut -d' ' -f1))
+size=$(printf '%d' 0x$(echo "$text" | sed 's/.*PROGBITS *//' | tr -s ' ' | cut -d' ' -f3))
+end=$((start + size))
+
+readelf -sW $1 | grep ' FUNC ' | while read num value symsize rest; do
+  addr=$(printf '%d' 0x${value})
+  name=${rest##* }
+  if [ ${addr} -lt ${start} ] || [ $((addr + symsize)) -gt ${end} ]; then
+    echo "$1: ${name} (0x${value}, ${symsize}) is outside .text" >&2
+    exit 1
+  fi
+done